@@ -20,8 +20,30 @@ struct hostent
     char **h_addr_list;
 };
 
+// Blocks until the name is resolved, or until all the DNS servers have failed to answer.
 struct hostent *gethostbyname(const char *name);
 
+// Asynchronous name lookups. dns_lookup_start() sends the query and returns a handle right away.
+// Several lookups can be waiting for a response at once. Check the result with dns_lookup_poll(),
+// or pass a done function. It is called from socket_run_callbacks() after the lookup finishes (or
+// right away, for addresses and cached names), and it must not block. Once a lookup is done,
+// gethostbyname() returns its full result from the cache without blocking.
+
+#define DNS_LOOKUP_PENDING 0
+#define DNS_LOOKUP_DONE    1
+#define DNS_LOOKUP_FAILED  2 // no address for the name, or no server answered
+
+// Returns a handle, or -1 if the name is invalid, there are no DNS servers or all handles are in
+// use.
+int dns_lookup_start(const char *name, void (*done)(int handle, void *userdata), void *userdata);
+
+// Returns DNS_LOOKUP_*, or -1 if the handle is invalid. When it's done, addr gets the first address
+// of the name (in network byte order, like sin_addr.s_addr).
+int dns_lookup_poll(int handle, unsigned long *addr);
+
+// Frees the handle. If the lookup is still pending, its response is ignored.
+void dns_lookup_close(int handle);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,6 +15,7 @@ extern "C" {
 
 #define INADDR_ANY       0x00000000
 #define INADDR_BROADCAST 0xFFFFFFFF
+#define INADDR_LOOPBACK  0x7F000001
 #define INADDR_NONE      0xFFFFFFFF
 
 struct in_addr
@@ -0,0 +1,45 @@
+// SPDX-License-Identifier: MIT
+//
+// Copyright (C) 2005-2006 Stephen Stair - sgstair@akkit.org - http://www.akkit.org
+
+// DSWifi Project - socket emulation layer defines/prototypes (netinet/tcp.h)
+
+#ifndef NETINET_TCP_H
+#define NETINET_TCP_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// (get/set)sockopt() options for level SOL_TCP (IPPROTO_TCP).
+#define TCP_INFO     11 // get a struct tcp_info (getsockopt only)
+#define TCP_FASTOPEN 23 // accept data on the SYN from TFO clients (listening sockets)
+
+// Connection statistics returned by getsockopt(SOL_TCP, TCP_INFO). Times are in milliseconds.
+struct tcp_info
+{
+    unsigned char tcpi_state;          // connection state
+    unsigned char tcpi_retransmits;    // retries of the segment currently being resent
+    unsigned short tcpi_pad;
+    unsigned long tcpi_rto;            // current retransmission timeout
+    unsigned long tcpi_rtt;            // smoothed round trip time, 0 until it has been measured
+    unsigned long tcpi_rttvar;         // round trip time variation
+    unsigned long tcpi_snd_wnd;        // bytes the peer allows us to send
+    unsigned long tcpi_rcv_wnd;        // bytes we allow the peer to send
+    unsigned long tcpi_snd_buf;        // bytes in the transmit buffer (unsent or unacknowledged)
+    unsigned long tcpi_rcv_buf;        // bytes in the receive buffer, not read yet
+    unsigned long tcpi_segs_out;       // segments sent, including retransmissions
+    unsigned long tcpi_segs_in;        // segments received
+    unsigned long tcpi_total_retrans;  // segments retransmitted
+    unsigned long tcpi_dup_acks;       // duplicate ACKs received
+    unsigned long tcpi_ooo_segs;       // segments received out of order (and dropped)
+    unsigned long tcpi_bytes_sent;     // data bytes sent, including retransmissions
+    unsigned long tcpi_bytes_acked;    // data bytes acknowledged by the peer
+    unsigned long tcpi_bytes_received; // data bytes received in order
+};
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
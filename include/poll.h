@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - socket emulation layer defines/prototypes (poll.h)
+
+#ifndef POLL_H
+#define POLL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// poll() events. POLLERR, POLLHUP and POLLNVAL are always reported, even if not requested.
+#define POLLIN   0x0001 // data (or a connection to accept) is waiting
+#define POLLPRI  0x0002 // not used
+#define POLLOUT  0x0004 // there is space to send data
+#define POLLERR  0x0008 // an error is pending, see getsockopt(SO_ERROR)
+#define POLLHUP  0x0010 // the connection is closed
+#define POLLNVAL 0x0020 // not a valid socket
+
+typedef unsigned int nfds_t;
+
+struct pollfd
+{
+    int fd;
+    short events;
+    short revents;
+};
+
+// timeout is in milliseconds, -1 waits forever.
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - socket emulation layer defines/prototypes (sys/epoll.h)
+
+#ifndef SYS_EPOLL_H
+#define SYS_EPOLL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Same values as the POLL* events in poll.h
+#define EPOLLIN  0x0001
+#define EPOLLPRI 0x0002
+#define EPOLLOUT 0x0004
+#define EPOLLERR 0x0008
+#define EPOLLHUP 0x0010
+
+#define EPOLLONESHOT 0x40000000 // disable the socket after one event, until EPOLL_CTL_MOD
+#define EPOLLET      0x80000000 // edge triggered: only report once per change
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+typedef union epoll_data
+{
+    void *ptr;
+    int fd;
+    unsigned int u32;
+    unsigned long long u64;
+} epoll_data_t;
+
+struct epoll_event
+{
+    unsigned int events;
+    epoll_data_t data;
+};
+
+// The returned descriptor is closed with closesocket().
+int epoll_create(int size);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+// timeout is in milliseconds, -1 waits forever.
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
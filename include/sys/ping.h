@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - socket emulation layer defines/prototypes (sys/ping.h)
+
+// ICMP echo ("ping") client, to measure the latency to a host. Open a handle for each target, call
+// ping_send() as often as needed (for example once a second) and read the results whenever they
+// are needed with ping_getstats(). Nothing blocks: replies are matched as they arrive.
+
+#ifndef SYS_PING_H
+#define SYS_PING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ping_stats
+{
+    int sent;     // echo requests sent
+    int received; // replies received in time
+    int lost;     // requests that got no reply within the timeout
+    int pending;  // requests still waiting for a reply
+
+    // Round trip times in milliseconds, -1 until the first reply arrives.
+    int rtt_last;
+    int rtt_min;
+    int rtt_avg;
+    int rtt_max;
+} ping_stats;
+
+// Returns a handle for pinging addr (an IPv4 address in network byte order, like sin_addr.s_addr),
+// or -1 if all handles are in use.
+int ping_open(unsigned long addr);
+
+// Sends an echo request with datalen bytes of payload (at least 4, which hold a timestamp).
+// Returns the sequence number of the request, or -1 on error.
+int ping_send(int handle, int datalen);
+
+// Fills in the statistics of all the requests sent with this handle. Returns 0, or -1 on error.
+int ping_getstats(int handle, ping_stats *stats);
+
+// Forgets the target and its statistics.
+void ping_close(int handle);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include <sys/time.h>
+#include <sys/uio.h>
 
 // Level number for (get/set)sockopt() to apply to socket itself.
 #define SOL_SOCKET 0xfff // options for socket level
@@ -35,7 +36,7 @@ extern "C" {
 #define SOCKET_ERROR -1
 
 // send()/recv()/etc flags
-// at present, only MSG_PEEK is implemented though.
+// at present, only MSG_PEEK and MSG_FASTOPEN are implemented though.
 #define MSG_WAITALL   0x40000000
 #define MSG_TRUNC     0x20000000
 #define MSG_PEEK      0x10000000
@@ -43,6 +44,7 @@ extern "C" {
 #define MSG_EOR       0x04000000
 #define MSG_DONTROUTE 0x02000000
 #define MSG_CTRUNC    0x01000000
+#define MSG_FASTOPEN  0x00800000 // sendto() on a TCP socket: connect, sending data on the SYN
 
 // shutdown() flags:
 #define SHUT_RD   1
@@ -73,12 +75,50 @@ extern "C" {
 #define SO_ERROR    0x1007 // get error status and clear
 #define SO_TYPE     0x1008 // get socket type
 
+// DSWifi extensions for UDP sockets, when the receive buffer (SO_RCVBUF) is full.
+#define SO_DROPPOLICY 0x1080 // which datagram to drop, SO_DROP_NEWEST (default) or SO_DROP_OLDEST
+#define SO_DROPCOUNT  0x1081 // get the number of datagrams dropped (getsockopt only)
+
+#define SO_DROP_NEWEST 0
+#define SO_DROP_OLDEST 1
+
+// Events reported to socket callbacks, see setsocketcallback().
+#define SOCKET_EVENT_READABLE  0x01 // data (or end of stream) can be received
+#define SOCKET_EVENT_WRITABLE  0x02 // buffer space became available for sending
+#define SOCKET_EVENT_ACCEPTED  0x04 // a listening socket has a connection ready for accept()
+#define SOCKET_EVENT_CONNECTED 0x08 // a TCP connection has been established
+#define SOCKET_EVENT_ERROR     0x10 // the connection failed or a connected UDP socket got an
+                                    // ICMP error, getsockopt(SO_ERROR) tells why
+
+typedef void (*socket_callback)(int socket, int events, void *userdata);
+
 struct sockaddr
 {
     unsigned short sa_family;
     char sa_data[14];
 };
 
+// Used by sendmsg()/recvmsg(). Control data isn't supported, msg_controllen is always set to 0.
+struct msghdr
+{
+    void *msg_name; // optional address (struct sockaddr_in)
+    int msg_namelen;
+    struct iovec *msg_iov; // scatter/gather array
+    int msg_iovlen;
+    void *msg_control;
+    int msg_controllen;
+    int msg_flags; // flags on received message (MSG_TRUNC)
+};
+
+// Used by sendmmsg()/recvmmsg().
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int msg_len; // bytes sent or received for this message
+};
+
+struct timespec;
+
 #ifndef ntohs
 #    define ntohs(num) htons(num)
 #    define ntohl(num) htonl(num)
@@ -93,6 +133,12 @@ int sendto(int socket, const void *data, int sendlength, int flags, const struct
            int addr_len);
 int recvfrom(int socket, void *data, int recvlength, int flags, struct sockaddr *addr,
              int *addr_len);
+int sendmsg(int socket, const struct msghdr *msg, int flags);
+int recvmsg(int socket, struct msghdr *msg, int flags);
+// Batched versions for UDP sockets. They return the number of messages sent or received.
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
 int listen(int socket, int max_connections);
 int accept(int socket, struct sockaddr *addr, int *addr_len);
 int shutdown(int socket, int shutdown_type);
@@ -114,6 +160,21 @@ unsigned long htonl(unsigned long num);
 
 int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
 
+// Registers a function to be called when any of 'events' (SOCKET_EVENT_*) happen on the socket,
+// replacing any previous one. Pass 0 events or a NULL callback to remove it. Events are reported
+// once when they become true. READABLE and ACCEPTED are reported again after a receive or accept()
+// call if there is still more left.
+//
+// Callbacks never run in interrupt context: the stack only records the events, and they are
+// delivered by socket_run_callbacks(). Callbacks may use the socket functions on non-blocking
+// sockets but must not block.
+int setsocketcallback(int socket, int events, socket_callback callback, void *userdata);
+
+// Runs the callbacks of the sockets that have had events since the last call, and the done
+// functions of finished DNS lookups (see dns_lookup_start()). Call it from the main loop, for
+// example once per frame.
+void socket_run_callbacks(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - socket emulation layer defines/prototypes (sys/socket_async.h)
+
+// Asynchronous socket operations. Each operation is described by an async_op owned by the caller,
+// which must stay valid until the operation is done or cancelled. Starting an operation puts the
+// socket in non-blocking mode and tries it right away; if it can't complete yet it's queued and
+// retried by async_run() when the stack reports activity on its socket. A socket that was blocking
+// is switched back once no operation is pending on it anymore. Call async_run() once per
+// frame and check async_done(op) (protothread friendly), or set op->done to be called when the
+// operation completes (for example, to resume a C++20 coroutine).
+
+#ifndef SYS_SOCKET_ASYNC_H
+#define SYS_SOCKET_ASYNC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/socket.h>
+
+enum async_op_state
+{
+    ASYNC_IDLE,    // not started, or cancelled
+    ASYNC_PENDING, // queued, waiting for the socket
+    ASYNC_DONE,    // finished, see result and error
+};
+
+typedef struct async_op
+{
+    int state;  // enum async_op_state
+    int result; // connect: 0, accept: new socket, send: bytes sent, recv: bytes received (0 on
+                // end of stream). -1 on failure.
+    int error;  // errno value if result is -1
+
+    void (*done)(struct async_op *op); // optional, called from async_run() on completion
+    void *userdata;
+
+    // Internal state
+    int type;
+    int socket;
+    int restoreblocking; // put the socket back in blocking mode when done
+    char *buffer;
+    int length, transferred;
+    struct sockaddr *addr;
+    int *addr_len;
+    struct async_op *next;
+} async_op;
+
+#define async_done(op) ((op)->state == ASYNC_DONE)
+
+// These return 0 if the operation was started (it may already be done), or -1 on invalid
+// arguments (for example, if op is already pending).
+int async_connect(async_op *op, int socket, const struct sockaddr *addr, int addr_len);
+int async_accept(async_op *op, int socket, struct sockaddr *addr, int *addr_len);
+int async_send(async_op *op, int socket, const void *data, int length); // sends all of data
+int async_recv(async_op *op, int socket, void *data, int length);       // any amount of data
+
+// Removes a pending operation from the queue without calling its done function.
+void async_cancel(async_op *op);
+
+// Retries the pending operations whose sockets have had activity. Returns the number of
+// operations still pending.
+int async_run(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - socket emulation layer defines/prototypes (sys/uio.h)
+
+#ifndef SYS_UIO_H
+#define SYS_UIO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#define IOV_MAX 16 // most buffers accepted by a single call
+
+struct iovec
+{
+    void *iov_base;
+    size_t iov_len;
+};
+
+// Only sockets are supported.
+int readv(int socket, const struct iovec *iov, int iovcnt);
+int writev(int socket, const struct iovec *iov, int iovcnt);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -357,6 +357,7 @@ int Wifi_AssocStatus(void)
                         wifi_connect_state = WIFI_CONNECT_DONE;
                         WifiData->flags9 |= WFLAG_ARM9_NETREADY;
                         sgIP_ARP_SendGratARP(wifi_hw);
+                        sgIP_ARP_ResolveNeighbours(wifi_hw);
                         sgIP_DNS_Record_Localhost();
                         return ASSOCSTATUS_ASSOCIATED;
                     default:
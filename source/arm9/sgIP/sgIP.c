@@ -8,11 +8,16 @@
 
 volatile unsigned long sgIP_timems;
 int sgIP_errno;
+unsigned long sgIP_randstate[4]; // see sgIP_Random(), stirred by sgIP_AddEntropy()
 
 // sgIP_Init(): Initializes sgIP hub and sets up a default surrounding interface (ARP and IP)
 void sgIP_Init(void)
 {
-    sgIP_timems = 0;
+    sgIP_timems       = 0;
+    sgIP_randstate[0] = 0x6A09E667; // any non-zero state, the entropy comes later
+    sgIP_randstate[1] = 0xBB67AE85;
+    sgIP_randstate[2] = 0x3C6EF372;
+    sgIP_randstate[3] = 0xA54FF53A;
     sgIP_memblock_Init();
     sgIP_Hub_Init();
     sgIP_sockets_Init();
@@ -45,7 +50,51 @@ void sgIP_Timer(int num_ms)
         if (count_1000ms >= 1000)
             count_1000ms = 0;
         sgIP_DNS_Timer1000ms();
+        sgIP_IP_Timer1000ms();
         sgIP_sockets_Timer1000ms();
     }
     sgIP_TCP_Timer();
+    sgIP_Hub_RunLoopback();
+    sgIP_DNS_Update();
+    SGIP_WAKEEVENT(); // let blocked threads check their timeouts
+}
+
+static unsigned long sgIP_RandomMix(unsigned long x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+// Returns 32 random bits (xorshift128 over the state, with a mixed output). They are only as hard
+// to guess as the entropy that has been added so far.
+unsigned long sgIP_Random(void)
+{
+    SGIP_INTR_PROTECT();
+    unsigned long t = sgIP_randstate[3];
+    unsigned long r = sgIP_randstate[0];
+    t ^= t << 11;
+    t ^= t >> 8;
+    sgIP_randstate[3] = sgIP_randstate[2];
+    sgIP_randstate[2] = sgIP_randstate[1];
+    sgIP_randstate[1] = r;
+    sgIP_randstate[0] = t ^ r ^ (r >> 19);
+    r                 = sgIP_RandomMix(sgIP_randstate[0] + sgIP_randstate[2]);
+    SGIP_INTR_UNPROTECT();
+    return r;
+}
+
+// Mixes something that is hard to predict (the hardware random number generator, the timing and
+// signal strength of received packets, ...) into the state of sgIP_Random().
+void sgIP_AddEntropy(unsigned long x)
+{
+    SGIP_INTR_PROTECT();
+    sgIP_randstate[0] ^= sgIP_RandomMix(x);
+    if (!(sgIP_randstate[0] | sgIP_randstate[1] | sgIP_randstate[2] | sgIP_randstate[3]))
+        sgIP_randstate[1] = 1; // xorshift never leaves the all-zero state
+    sgIP_Random();
+    SGIP_INTR_UNPROTECT();
 }
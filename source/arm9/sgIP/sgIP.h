@@ -27,6 +27,8 @@ extern volatile unsigned long sgIP_timems;
 
 void sgIP_Init(void);
 void sgIP_Timer(int num_ms);
+unsigned long sgIP_Random(void);
+void sgIP_AddEntropy(unsigned long x);
 
 #ifdef __cplusplus
 };
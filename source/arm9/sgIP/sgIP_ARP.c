@@ -7,28 +7,93 @@
 #include "arm9/sgIP/sgIP_ARP.h"
 
 sgIP_ARP_Record ArpRecords[SGIP_ARP_MAXENTRIES];
+unsigned long sgIP_ARP_generation; // changes whenever a resolved address is dropped or changed
+unsigned long sgIP_ARP_dropped;    // packets freed while waiting for an address to be resolved
+
+// Active records are linked in chains by the hash of their address, free records in another one.
+static short arphash[SGIP_ARP_HASHSIZE];
+static short arpfree;
+static short arplast; // record of the last destination that was looked up, or -1
+
+static int sgIP_ARP_Hash(unsigned long ipaddr)
+{
+    ipaddr ^= ipaddr >> 16;
+    ipaddr ^= ipaddr >> 8;
+    return ipaddr & (SGIP_ARP_HASHSIZE - 1);
+}
+
+// Frees the packets waiting for the address of a record.
+static void sgIP_ARP_DropQueued(int i)
+{
+    for (int n = 0; n < ArpRecords[i].queued_count; n++)
+        sgIP_memblock_free(ArpRecords[i].queued_packets[n]);
+    sgIP_ARP_dropped += ArpRecords[i].queued_count;
+    ArpRecords[i].queued_count = 0;
+}
+
+// Makes a packet (with its ethernet header exposed) wait for the address of a record.
+static void sgIP_ARP_QueuePacket(int i, sgIP_memblock *mb, unsigned short protocol)
+{
+    if (ArpRecords[i].queued_count == SGIP_ARP_MAXQUEUED)
+    {
+        // the queue is full, reject the new one.
+        sgIP_memblock_free(mb);
+        sgIP_ARP_dropped++;
+        return;
+    }
+    sgIP_memblock_exposeheader(mb, -14); // re-hide ethernet header.
+    ArpRecords[i].queued_packets[ArpRecords[i].queued_count++] = mb;
+    ArpRecords[i].linked_protocol                              = protocol;
+}
+
+// Unlinks an active record from its hash chain and puts it in the free list.
+static void sgIP_ARP_FreeSlot(int i)
+{
+    short *link = &arphash[sgIP_ARP_Hash(ArpRecords[i].protocol_address)];
+    while (*link != -1 && *link != i)
+        link = &ArpRecords[*link].hashnext;
+    if (*link == i)
+        *link = ArpRecords[i].hashnext;
+
+    sgIP_ARP_DropQueued(i);
+
+    ArpRecords[i].flags      = 0;
+    ArpRecords[i].retrycount = 0;
+    ArpRecords[i].idletime   = 0;
+    ArpRecords[i].hashnext   = arpfree;
+    arpfree                  = i;
+    if (arplast == i)
+        arplast = -1;
+}
 
 int sgIP_FindArpSlot(sgIP_Hub_HWInterface *hw, unsigned long destip)
 {
-    for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
+    // most packets go to the same place as the previous one, usually the gateway.
+    if (arplast != -1 && ArpRecords[arplast].linked_interface == hw
+        && ArpRecords[arplast].protocol_address == destip)
+        return arplast;
+
+    for (int i = arphash[sgIP_ARP_Hash(destip)]; i != -1; i = ArpRecords[i].hashnext)
     {
-        if (ArpRecords[i].flags & SGIP_ARP_FLAG_ACTIVE)
+        if (ArpRecords[i].linked_interface == hw && ArpRecords[i].protocol_address == destip)
         {
-            if (ArpRecords[i].linked_interface == hw && ArpRecords[i].protocol_address == destip)
-                return i;
+            arplast = i;
+            return i;
         }
     }
     return -1;
 }
 
-int sgIP_GetArpSlot(void)
+// Gets a free record for destip and links it in its hash chain. If there are none left, the one
+// that has been idle for the longest time is recycled.
+int sgIP_GetArpSlot(sgIP_Hub_HWInterface *hw, unsigned long destip)
 {
-    int m     = 0;
-    int midle = 0;
-
-    for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
+    if (arpfree == -1)
     {
-        if (ArpRecords[i].flags & SGIP_ARP_FLAG_ACTIVE)
+        int m               = 0;
+        unsigned long midle = 0;
+
+        for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
         {
             if (ArpRecords[i].idletime >= midle)
             {
@@ -36,21 +101,21 @@ int sgIP_GetArpSlot(void)
                 m     = i;
             }
         }
-        else
-        {
-            return i;
-        }
-    }
 
-    // this slot *was* in use, so let's fix that situation.
-    if (ArpRecords[m].queued_packet)
-        sgIP_memblock_free(ArpRecords[m].queued_packet);
+        // this slot *was* in use, so let's fix that situation.
+        sgIP_ARP_generation++;
+        sgIP_ARP_FreeSlot(m);
+    }
 
-    ArpRecords[m].flags         = 0;
-    ArpRecords[m].retrycount    = 0;
-    ArpRecords[m].idletime      = 0;
-    ArpRecords[m].queued_packet = 0;
-    return m;
+    int i                          = arpfree;
+    int hash                       = sgIP_ARP_Hash(destip);
+    arpfree                        = ArpRecords[i].hashnext;
+    ArpRecords[i].age              = 0;
+    ArpRecords[i].linked_interface = hw;
+    ArpRecords[i].protocol_address = destip;
+    ArpRecords[i].hashnext         = arphash[hash];
+    arphash[hash]                  = i;
+    return i;
 }
 
 int sgIP_is_broadcast_address(sgIP_Hub_HWInterface *hw, unsigned long ipaddr)
@@ -74,10 +139,17 @@ void sgIP_ARP_Init(void)
 {
     for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
     {
-        ArpRecords[i].flags         = 0;
-        ArpRecords[i].idletime      = 0;
-        ArpRecords[i].queued_packet = 0;
+        ArpRecords[i].flags        = 0;
+        ArpRecords[i].idletime     = 0;
+        ArpRecords[i].queued_count = 0;
+        ArpRecords[i].hashnext     = i + 1 < SGIP_ARP_MAXENTRIES ? i + 1 : -1;
     }
+    for (int i = 0; i < SGIP_ARP_HASHSIZE; i++)
+        arphash[i] = -1;
+    arpfree             = 0;
+    arplast             = -1;
+    sgIP_ARP_generation = 0;
+    sgIP_ARP_dropped    = 0;
 }
 
 void sgIP_ARP_Timer100ms(void)
@@ -92,13 +164,8 @@ void sgIP_ARP_Timer100ms(void)
                 ArpRecords[i].retrycount++;
                 if (ArpRecords[i].retrycount > 125)
                 {
-                    // it's a lost cause.
-                    if (ArpRecords[i].queued_packet)
-                    {
-                        // if there is already a queued packet, kill it.
-                        sgIP_memblock_free(ArpRecords[i].queued_packet);
-                    }
-                    ArpRecords[i].flags = 0;
+                    // it's a lost cause. This also kills the queued packets.
+                    sgIP_ARP_FreeSlot(i);
                     continue;
                 }
                 if ((ArpRecords[i].retrycount & 7) == 7)
@@ -109,18 +176,74 @@ void sgIP_ARP_Timer100ms(void)
                                             ArpRecords[i].protocol_address);
                 }
             }
+            else
+            {
+                ArpRecords[i].age++;
+                if (ArpRecords[i].age >= SGIP_ARP_MAXAGEMS / 100)
+                {
+                    sgIP_ARP_generation++;
+                    sgIP_ARP_FreeSlot(i);
+                    continue;
+                }
+                // addresses used recently are confirmed before they expire, while packets keep
+                // using the old one.
+                int refresh = ArpRecords[i].age - SGIP_ARP_REFRESHMS / 100;
+                if (refresh >= 0 && (refresh & 7) == 0
+                    && ArpRecords[i].idletime < SGIP_ARP_REFRESHMS / 100)
+                {
+                    sgIP_ARP_SendARPRequest(ArpRecords[i].linked_interface,
+                                            ArpRecords[i].linked_protocol,
+                                            ArpRecords[i].protocol_address);
+                }
+            }
         }
     }
 }
 
 void sgIP_ARP_FlushInterface(sgIP_Hub_HWInterface *hw)
 {
+    sgIP_ARP_generation++;
     for (int i = 0; i < SGIP_ARP_MAXENTRIES; i++)
     {
-        if (ArpRecords[i].linked_interface == hw)
-            ArpRecords[i].flags = 0;
-        if (hw == 0)
-            ArpRecords[i].flags = 0; // flush all interfaces
+        if (!(ArpRecords[i].flags & SGIP_ARP_FLAG_ACTIVE))
+            continue;
+        if (ArpRecords[i].linked_interface == hw || hw == 0) // hw == 0 flushes all interfaces
+            sgIP_ARP_FreeSlot(i);
+    }
+}
+
+// Starts resolving ipaddr ahead of time, so that the first packet sent to it doesn't have to wait.
+void sgIP_ARP_Resolve(sgIP_Hub_HWInterface *hw, unsigned long ipaddr)
+{
+    if (!hw || !ipaddr || sgIP_is_broadcast_address(hw, ipaddr))
+        return;
+
+    SGIP_INTR_PROTECT();
+    if (sgIP_FindArpSlot(hw, ipaddr) == -1)
+    {
+        int m                         = sgIP_GetArpSlot(hw, ipaddr);
+        ArpRecords[m].flags           = SGIP_ARP_FLAG_ACTIVE;
+        ArpRecords[m].idletime        = 0;
+        ArpRecords[m].retrycount      = 0;
+        ArpRecords[m].linked_protocol = PROTOCOL_ETHER_IP;
+        sgIP_ARP_SendARPRequest(hw, PROTOCOL_ETHER_IP, ipaddr);
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
+// Resolves the neighbours that the first packets will go to: the gateway, and the next hops to the
+// DNS servers. Call it when the interface gets its address or its link comes up.
+void sgIP_ARP_ResolveNeighbours(sgIP_Hub_HWInterface *hw)
+{
+    if (!hw || !hw->ipaddr)
+        return;
+
+    sgIP_ARP_Resolve(hw, hw->gateway);
+    for (int n = 0; n < 3; n++)
+    {
+        unsigned long nexthop;
+        if (hw->dns[n] && sgIP_Hub_Route(hw->dns[n], hw->ipaddr, &nexthop) == hw)
+            sgIP_ARP_Resolve(hw, nexthop);
     }
 }
 
@@ -174,14 +297,28 @@ int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
         i = sgIP_FindArpSlot(hw, ip);
         if (i != -1) // we've been waiting for you...
         {
+            ArpRecords[i].age = 0;
             for (j = 0; j < arp->hw_addr_len; j++)
+            {
+                // refreshes usually confirm the same address, only a new one invalidates routes.
+                if ((ArpRecords[i].flags & SGIP_ARP_FLAG_HAVEHWADDR)
+                    && ArpRecords[i].hw_address[j] != (char)arp->addresses[j])
+                    sgIP_ARP_generation++;
                 ArpRecords[i].hw_address[j] = arp->addresses[j];
+            }
             ArpRecords[i].flags |= SGIP_ARP_FLAG_HAVEHWADDR;
-            sgIP_memblock *mb2;
-            mb2                         = ArpRecords[i].queued_packet;
-            ArpRecords[i].queued_packet = 0;
-            if (mb2)
-                sgIP_ARP_SendProtocolFrame(hw, mb2, ArpRecords[i].linked_protocol, ip);
+
+            // send everything that was waiting, in order, and in a single batch.
+            sgIP_memblock *queued[SGIP_ARP_MAXQUEUED];
+            int count                  = ArpRecords[i].queued_count;
+            int protocol               = ArpRecords[i].linked_protocol;
+            ArpRecords[i].queued_count = 0;
+            for (j = 0; j < count; j++)
+                queued[j] = ArpRecords[i].queued_packets[j];
+            sgIP_Hub_BeginBatch();
+            for (j = 0; j < count; j++)
+                sgIP_ARP_SendProtocolFrame(hw, queued[j], protocol, ip);
+            sgIP_Hub_EndBatch();
         }
     }
 
@@ -189,6 +326,38 @@ int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
     return 0;
 }
 
+// Looks up the hardware address of destaddr, without sending anything. Returns 1 and copies it to
+// hwaddr if it's known (broadcast addresses always are). slot gets the record it came from (-1 for
+// broadcasts), which can be passed to sgIP_ARP_Touch() until sgIP_ARP_generation changes.
+int sgIP_ARP_Lookup(sgIP_Hub_HWInterface *hw, unsigned long destaddr, unsigned char *hwaddr,
+                    int *slot)
+{
+    int i, j;
+    *slot = -1;
+    if (sgIP_is_broadcast_address(hw, destaddr))
+    {
+        for (j = 0; j < hw->hwaddrlen; j++)
+            hwaddr[j] = 0xFF;
+        return 1;
+    }
+    i = sgIP_FindArpSlot(hw, destaddr);
+    if (i == -1 || !(ArpRecords[i].flags & SGIP_ARP_FLAG_HAVEHWADDR))
+        return 0;
+    ArpRecords[i].idletime = 0;
+    for (j = 0; j < hw->hwaddrlen; j++)
+        hwaddr[j] = ArpRecords[i].hw_address[j];
+    *slot = i;
+    return 1;
+}
+
+// Marks the record returned by sgIP_ARP_Lookup() as used, for callers that send with a cached
+// hardware address. This keeps it from looking idle, so it's refreshed instead of expiring.
+void sgIP_ARP_Touch(int slot)
+{
+    if (slot >= 0 && slot < SGIP_ARP_MAXENTRIES)
+        ArpRecords[slot].idletime = 0;
+}
+
 int sgIP_ARP_SendProtocolFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, unsigned short protocol,
                                unsigned long destaddr)
 {
@@ -236,32 +405,16 @@ int sgIP_ARP_SendProtocolFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, unsi
         else
         {
             // we don't have the address, but are looking for it.
-
-            if (ArpRecords[i].queued_packet)
-            {
-                // if there is already a queued packet, reject the new one.
-                sgIP_memblock_free(mb);
-                return 0; // couldn't send.
-            }
-            else
-            {
-                sgIP_memblock_exposeheader(mb, -14);      // re-hide ethernet header.
-                ArpRecords[i].queued_packet   = mb;       // queue packet.
-                ArpRecords[i].linked_protocol = protocol; // queue packet.
-                return 0;
-            }
+            sgIP_ARP_QueuePacket(i, mb, protocol);
+            return 0;
         }
     }
-    m = sgIP_GetArpSlot(); // gets and cleans out an arp slot for us
-                           // build new record
-    ArpRecords[m].flags            = SGIP_ARP_FLAG_ACTIVE;
-    ArpRecords[m].idletime         = 0;
-    ArpRecords[m].retrycount       = 0;
-    ArpRecords[m].linked_interface = hw;
-    ArpRecords[m].protocol_address = destaddr;
-    sgIP_memblock_exposeheader(mb, -14); // re-hide ethernet header.
-    ArpRecords[m].queued_packet   = mb;
-    ArpRecords[m].linked_protocol = protocol;
+    m = sgIP_GetArpSlot(hw, destaddr); // gets and cleans out an arp slot for us
+    // build new record
+    ArpRecords[m].flags      = SGIP_ARP_FLAG_ACTIVE;
+    ArpRecords[m].idletime   = 0;
+    ArpRecords[m].retrycount = 0;
+    sgIP_ARP_QueuePacket(m, mb, protocol);
     sgIP_ARP_SendARPRequest(hw, protocol, destaddr);
     return 0; // queued, but not sent yet.
 }
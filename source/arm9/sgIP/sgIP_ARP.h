@@ -21,9 +21,12 @@ extern "C" {
 typedef struct SGIP_ARP_RECORD
 {
     unsigned short flags, retrycount;
+    short hashnext; // next record in the same hash chain (or in the free list), -1 at the end
     unsigned long idletime;
+    unsigned short age; // 100ms ticks since the address was last confirmed
     sgIP_Hub_HWInterface *linked_interface;
-    sgIP_memblock *queued_packet;
+    sgIP_memblock *queued_packets[SGIP_ARP_MAXQUEUED]; // oldest first, with the header hidden
+    unsigned short queued_count;
     int linked_protocol;
     unsigned long protocol_address;
     char hw_address[SGIP_MAXHWADDRLEN];
@@ -41,12 +44,20 @@ typedef struct SGIP_HEADER_ARP
 
 #define SGIP_HEADER_ARP_BASESIZE 8
 
+extern unsigned long sgIP_ARP_generation;
+extern unsigned long sgIP_ARP_dropped;
+
 void sgIP_ARP_Init(void);
 void sgIP_ARP_Timer100ms(void);
 void sgIP_ARP_FlushInterface(sgIP_Hub_HWInterface *hw);
+void sgIP_ARP_Resolve(sgIP_Hub_HWInterface *hw, unsigned long ipaddr);
+void sgIP_ARP_ResolveNeighbours(sgIP_Hub_HWInterface *hw);
 
 int sgIP_ARP_ProcessIPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb);
 int sgIP_ARP_ProcessARPFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb);
+int sgIP_ARP_Lookup(sgIP_Hub_HWInterface *hw, unsigned long destaddr, unsigned char *hwaddr,
+                    int *slot);
+void sgIP_ARP_Touch(int slot);
 int sgIP_ARP_SendProtocolFrame(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb, unsigned short protocol,
                                unsigned long destaddr);
 
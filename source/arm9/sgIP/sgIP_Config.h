@@ -34,6 +34,12 @@ extern "C" {
 //  memory areas or allocation/deallocation of memory, and are restored afterwards.
 #define SGIP_INTERRUPT_THREADING_MODEL
 
+// SGIP_COTHREAD_WAIT: Used with SGIP_INTERRUPT_THREADING_MODEL. Blocking socket calls park the
+//  calling cooperative thread (libnds cothreads) until the stack signals that something has
+//  happened, so other threads keep running while one waits in recv(), accept(), etc. The stack
+//  itself still runs from interrupt handlers, so data is still protected by disabling interrupts.
+#define SGIP_COTHREAD_WAIT
+
 // SGIP_MULTITHREADED_THREADING_MODEL: Standard memory protection for large multithreaded
 //  systems, such as operating systems and the like.  This kind of memory protection is
 //  useful for true multithreaded systems but useless in a single-threaded system and
@@ -96,6 +102,42 @@ extern "C" {
 //  manually override this value.
 #define SGIP_IP_TTL 128
 
+// SGIP_IP_PMTU_MAXENTRIES: The number of destinations whose path MTU (learnt from ICMP
+//  "fragmentation needed" messages) is remembered. The oldest entry is reused when it's full.
+#define SGIP_IP_PMTU_MAXENTRIES 8
+
+// SGIP_IP_PMTU_TIMEOUTMS: Time after which a learnt path MTU is forgotten, so that the stack
+//  notices if the path gets a larger MTU again.
+#define SGIP_IP_PMTU_TIMEOUTMS (10 * 60 * 1000)
+
+// SGIP_IP_PMTU_MIN: The lowest path MTU that will be accepted from an ICMP message.
+#define SGIP_IP_PMTU_MIN 576
+
+// SGIP_ICMP_PING_MAXTARGETS: The number of ping handles (see sys/ping.h) that can be open at once.
+#define SGIP_ICMP_PING_MAXTARGETS 4
+
+// SGIP_ICMP_PING_WINDOW: The number of echo requests per target that can wait for a reply at once.
+//  Sending more counts the oldest one as lost.
+#define SGIP_ICMP_PING_WINDOW 16
+
+// SGIP_ICMP_PING_TIMEOUTMS: Time after which an echo request without reply is counted as lost.
+#define SGIP_ICMP_PING_TIMEOUTMS 2000
+
+// SGIP_IP_REASSEMBLY_MAXPACKETS: The number of fragmented packets that can be reassembled at once.
+//  When the table is full the oldest packet is dropped to make room for a new one.
+#define SGIP_IP_REASSEMBLY_MAXPACKETS 4
+
+// SGIP_IP_REASSEMBLY_MAXFRAGMENTS: The maximum number of fragments a packet can be split in.
+#define SGIP_IP_REASSEMBLY_MAXFRAGMENTS 16
+
+// SGIP_IP_REASSEMBLY_MAXBYTES: The maximum number of bytes (counting IP headers) held by all the
+//  packets being reassembled.
+#define SGIP_IP_REASSEMBLY_MAXBYTES 16384
+
+// SGIP_IP_REASSEMBLY_TIMEOUTMS: Time after its first fragment arrives before an incomplete packet
+//  is dropped.
+#define SGIP_IP_REASSEMBLY_TIMEOUTMS 5000
+
 // SGIP_TCPRECEIVEBUFFERLENGTH: The size (in bytes) of the receive FIFO in a TCP connection
 #define SGIP_TCP_RECEIVEBUFFERLENGTH 8192
 
@@ -110,21 +152,54 @@ extern "C" {
 //  (at least on most smaller systems)
 #define SGIP_ARP_MAXENTRIES 32
 
+// SGIP_ARP_HASHSIZE: The number of hash chains the ARP entries are looked up in. It must be a
+//  power of two.
+#define SGIP_ARP_HASHSIZE 16
+
+// SGIP_ARP_MAXQUEUED: The number of packets to an address that can wait for it to be resolved.
+//  Packets sent when the queue is full are dropped (and counted in sgIP_ARP_dropped).
+#define SGIP_ARP_MAXQUEUED 4
+
+// SGIP_ARP_REFRESHMS: Age after which a resolved address that is still in use is asked for again
+//  in the background, so that packets to it never wait for a reply.
+#define SGIP_ARP_REFRESHMS (60 * 1000)
+
+// SGIP_ARP_MAXAGEMS: Age after which a resolved address that hasn't been confirmed is forgotten.
+#define SGIP_ARP_MAXAGEMS (120 * 1000)
+
 // SGIP_HUB_MAXHWINTERFACES: The maximum number of hardware interfaces the sgIP hub will
 //  connect to. A hardware interface being some port (ethernet, wifi, etc) that will relay
-//  packets to the outside world.
-#define SGIP_HUB_MAXHWINTERFACES 1
+//  packets to the outside world. The loopback interface doesn't count.
+#define SGIP_HUB_MAXHWINTERFACES 3
+
+// SGIP_HUB_MAXROUTES: The number of routes that can be added with sgIP_Hub_AddRoute(), on top
+//  of the ones every interface has to its own network and to its gateway.
+#define SGIP_HUB_MAXROUTES 8
+
+// SGIP_HUB_ROUTECACHE: The number of entries in the cache of route lookups, indexed by
+//  destination address.
+#define SGIP_HUB_ROUTECACHE 8
 
 // SGIP_HUB_MAXPROTOCOLINTERFACES: The maximum number of protocol interfaces the sgIP hub will
 //  connect to. A protocol interface being a software handler for a certain protocol type
 //  (such as IP)
 #define SGIP_HUB_MAXPROTOCOLINTERFACES 1
 
+// SGIP_HUB_LOOPBACK_QUEUE: The number of packets sent to the loopback interface (127.0.0.0/8 and
+//  our own addresses) that can wait to be received. Packets sent when it's full are dropped.
+#define SGIP_HUB_LOOPBACK_QUEUE 32
+
 #define SGIP_TCP_FIRSTOUTGOINGPORT 40000
 #define SGIP_TCP_LASTOUTGOINGPORT  65000
 #define SGIP_UDP_FIRSTOUTGOINGPORT 40000
 #define SGIP_UDP_LASTOUTGOINGPORT  65000
 
+// SGIP_UDP_RCVBUF_DEFAULT: Default limit (in bytes, SO_RCVBUF) on the datagrams a UDP socket can
+//  have waiting to be received. Datagrams that would go over it are dropped, but a socket with
+//  nothing queued always takes one, however big (see SGIP_IP_REASSEMBLY_MAXBYTES).
+#define SGIP_UDP_RCVBUF_DEFAULT 8192
+#define SGIP_UDP_RCVBUF_MAX     65536
+
 #define SGIP_TCP_GENTIMEOUTMS       6000
 #define SGIP_TCP_TRANSMIT_DELAY     25
 #define SGIP_TCP_TRANSMIT_IMMTHRESH 40
@@ -133,12 +208,31 @@ extern "C" {
 #define SGIP_TCP_MAXSYNS            64
 #define SGIP_TCP_REACK_THRESH       1000
 
+// SGIP_TCP_MAXTIMEWAIT: The number of connections that can be held in TIME_WAIT at once. These
+//  entries only keep the connection addresses and sequence numbers, the full TCP record is freed
+//  as soon as the connection enters TIME_WAIT. When the table is full the entry closest to
+//  expiring is reused.
+#define SGIP_TCP_MAXTIMEWAIT 32
+
+// SGIP_TCP_FASTOPEN: Enables TCP Fast Open (RFC 7413). Clients request a cookie from every server
+//  they connect to and cache it, so that later sendto(MSG_FASTOPEN) calls can put data on the SYN.
+//  Listening sockets only hand out and accept cookies once TCP_FASTOPEN is set on them.
+#define SGIP_TCP_FASTOPEN
+
+// SGIP_TCP_FASTOPEN_MAXCOOKIES: The number of servers whose Fast Open cookie is remembered. The
+//  least recently used cookie is dropped when a new server has to be added.
+#define SGIP_TCP_FASTOPEN_MAXCOOKIES 8
+
 #define SGIP_TCP_SYNRETRYMS 250
 #define SGIP_TCP_GENRETRYMS 500
 #define SGIP_TCP_BACKOFFMAX 6000
 
 #define SGIP_SOCKET_MAXSOCKETS 32
 
+// SGIP_SOCKET_MAXEPOLL: The number of epoll instances that can exist at once. Each one also takes
+//  up a socket.
+#define SGIP_SOCKET_MAXEPOLL 4
+
 // #define SGIP_SOCKET_DEFAULT_NONBLOCK			1
 
 //////////////////////////////////////////////////////////////////////////
@@ -150,6 +244,7 @@ extern "C" {
 #define SGIP_DNS_TIMEOUTMS       5000
 #define SGIP_DNS_MAXRETRY        3
 #define SGIP_DNS_MAXSERVERRETRY  4
+#define SGIP_DNS_MAXLOOKUPS      4 // lookups that can be waiting for a response at once
 
 //////////////////////////////////////////////////////////////////////////
 
@@ -203,18 +298,40 @@ extern int sgIP_errno;
 #include <nds/interrupts.h>
 
 #ifdef SGIP_INTERRUPT_THREADING_MODEL
-void sgIP_IntrWaitEvent(void);
+extern volatile unsigned long sgIP_sockets_events;
+void sgIP_IntrWaitEvent(unsigned long seen);
 #    define SGIP_INTR_PROTECT()   int tIME = enterCriticalSection()
 #    define SGIP_INTR_REPROTECT() tIME = enterCriticalSection()
 #    define SGIP_INTR_UNPROTECT() leaveCriticalSection(tIME)
-#    define SGIP_WAITEVENT()      sgIP_IntrWaitEvent()
+// Waits for something to happen, unless sgIP_sockets_events has moved on from 'seen' (read while
+// protected, right after checking whatever the caller is waiting for).
+#    define SGIP_WAITEVENT(seen) sgIP_IntrWaitEvent(seen)
+// Leaves the protected section to wait for something to happen, and enters it again. An event
+// that comes in after the caller's check and before the wait still wakes it.
+#    define SGIP_INTR_WAITEVENT()                     \
+        do                                            \
+        {                                             \
+            unsigned long sEEN = sgIP_sockets_events; \
+            SGIP_INTR_UNPROTECT();                    \
+            sgIP_IntrWaitEvent(sEEN);                 \
+            SGIP_INTR_REPROTECT();                    \
+        } while (0)
 #else // !SGIP_INTERRUPT_THREADING_MODEL
 #    define SGIP_INTR_PROTECT()
 #    define SGIP_INTR_REPROTECT()
 #    define SGIP_INTR_UNPROTECT()
-#    define SGIP_WAITEVENT() ;
+#    define SGIP_WAITEVENT(seen) ;
+#    define SGIP_INTR_WAITEVENT() ;
 #endif // SGIP_INTERRUPT_THREADING_MODEL
 
+#if defined(SGIP_INTERRUPT_THREADING_MODEL) && defined(SGIP_COTHREAD_WAIT)
+#    include <nds/cothread.h>
+#    define SGIP_COTHREAD_SIGNAL 0x73674950 // "sgIP", threads waiting in SGIP_WAITEVENT
+#    define SGIP_WAKEEVENT()     cothread_send_signal(SGIP_COTHREAD_SIGNAL)
+#else
+#    define SGIP_WAKEEVENT()
+#endif
+
 #ifdef SGIP_DEBUG
 void sgIP_dbgprint(char *, ...);
 #endif // SGIP_DEBUG
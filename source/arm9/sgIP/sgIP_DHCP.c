@@ -8,6 +8,7 @@
 #include <string.h>
 #include <sys/socket.h>
 
+#include "arm9/sgIP/sgIP_ARP.h"
 #include "arm9/sgIP/sgIP_DHCP.h"
 #include "arm9/sgIP/sgIP_DNS.h"
 
@@ -252,6 +253,7 @@ int sgIP_DHCP_Update(void)
                                 dhcp_int->ipaddr  = dhcp_rcvd_ip;
                                 dhcp_int->gateway = dhcp_rcvd_gateway;
                                 dhcp_int->snmask  = dhcp_rcvd_snmask;
+                                sgIP_Hub_RoutesChanged();
                                 SGIP_DEBUG_MESSAGE(("DHCP Configured!"));
                                 SGIP_DEBUG_MESSAGE(("IP%08X SM%08X GW%08X", dhcp_rcvd_ip,
                                                     dhcp_rcvd_snmask, dhcp_rcvd_gateway));
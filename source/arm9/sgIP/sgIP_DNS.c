@@ -8,17 +8,40 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <netdb.h>
 #include <sys/socket.h>
 
 #include "arm9/sgIP/sgIP_DNS.h"
 #include "arm9/sgIP/sgIP_Hub.h"
 
-int dns_sock;
+// One socket per server in dns[], connected to it so that ICMP errors reach it. They are shared by
+// the lookups waiting for a response, and closed when there are none.
+int dns_socks[3];
+unsigned long dns_sockip[3]; // server each socket is connected to
 int time_count;
-int last_id;
-int query_time_start;
+unsigned short dns_nextid; // transaction ID of the next query
 extern volatile unsigned long sgIP_timems;
 
+typedef struct SGIP_DNS_LOOKUP
+{
+    unsigned char inuse;
+    unsigned char notify;   // finished, the done function has to be called
+    unsigned char server;   // index in dns[] of the server being asked
+    unsigned char retries;  // queries sent to that server without a response
+    int state;              // DNS_LOOKUP_*
+    unsigned short id;      // transaction ID of the query, in network byte order
+    unsigned long serverip; // address the query was sent to
+    unsigned long sendtime; // sgIP_timems when the query was sent
+    unsigned long addr;     // first address of the answer
+    void (*done)(int handle, void *userdata);
+    void *userdata;
+    char name[256];
+} sgIP_DNS_Lookup;
+
+static sgIP_DNS_Lookup dnslookups[SGIP_DNS_MAXLOOKUPS];
+
+static void sgIP_DNS_RetryLookups(void);
+
 // cache record data
 sgIP_DNS_Record *dnsrecords[SGIP_DNS_MAXRECORDSCACHE];
 
@@ -38,7 +61,11 @@ void sgIP_DNS_Init(void)
     for (int i = 0; i < SGIP_DNS_MAXRECORDSCACHE; i++)
         dnsrecords[i] = NULL;
 
-    dns_sock   = -1;
+    for (int i = 0; i < SGIP_DNS_MAXLOOKUPS; i++)
+        dnslookups[i].inuse = 0;
+
+    for (int i = 0; i < 3; i++)
+        dns_socks[i] = -1;
     time_count = 0;
 }
 
@@ -58,6 +85,8 @@ void sgIP_DNS_Timer1000ms(void)
             }
         }
     }
+
+    sgIP_DNS_RetryLookups();
 }
 
 int sgIP_DNS_isipaddress(const char *name, unsigned long *ipdest)
@@ -172,6 +201,11 @@ sgIP_DNS_Record *sgIP_DNS_FindDNSRecord(const char *name)
             && (dnsrecords[rec]->flags & (SGIP_DNS_FLAG_ACTIVE | SGIP_DNS_FLAG_RESOLVED))
                    == (SGIP_DNS_FLAG_ACTIVE | SGIP_DNS_FLAG_RESOLVED))
         {
+            if (!strcasecmp(name, dnsrecords[rec]->name))
+            {
+                SGIP_INTR_UNPROTECT();
+                return dnsrecords[rec];
+            }
             for (int ali = 0; ali < dnsrecords[rec]->numalias; ali++)
             {
                 if (!strcasecmp(name, dnsrecords[rec]->aliases[ali]))
@@ -320,14 +354,13 @@ sgIP_DNS_Hostent *sgIP_DNS_GenerateHostent(sgIP_DNS_Record *dnsrec)
     return (sgIP_DNS_Hostent *)&dnsrecord_hostent;
 }
 
-static int sgIP_DNS_genquery(const char *name)
+static int sgIP_DNS_genquery(const char *name, unsigned short id)
 {
     int i, j, c, l;
     unsigned short *querydata_s = (unsigned short *)querydata;
     unsigned char *querydata_c  = querydata;
     // header section
-    querydata_s[0] = htons(time_count & 0xFFFF);
-    last_id        = querydata_s[0];
+    querydata_s[0] = id;
     querydata_s[1] = htons(0x0100); // recursion desired, standard query
     querydata_s[2] = htons(1);      // one QD (question)
     querydata_s[3] = 0;             // no resource records
@@ -399,205 +432,453 @@ void sgIP_DNS_CopyAliasAt(char *deststr, int offset)
     deststr[i] = 0;
 }
 
-sgIP_DNS_Hostent *sgIP_DNS_gethostbyname(const char *name)
+// Parses the response to a query for name (in responsedata) and puts it in the cache. Returns 1
+// and the first address found, or 0 if the response has no address.
+static int sgIP_DNS_ParseResponse(const char *name, int len, unsigned long *addr)
 {
+    const unsigned short *resdata_s = (unsigned short *)responsedata;
+    const unsigned char *resdata_c  = responsedata;
+    const unsigned char *resdata_e  = responsedata + len;
     sgIP_DNS_Record *rec;
-    sgIP_DNS_Hostent *he;
-    sgIP_Hub_HWInterface *hw;
-    int len, i, sainlen;
-    int retries, dtime;
-    unsigned long serverip;
+    const char *c;
+    int i, j, q, a, nalias, naddr;
+
+    q = htons(resdata_s[2]);
+    a = htons(resdata_s[3]);
+    // no answer.
+    if (a == 0)
+        return 0;
+
+    resdata_c += 12;
+    while (q)
+    {
+        // ignore questions
+        do
+        {
+            j = resdata_c[0];
+            if (j > 63)
+            {
+                resdata_c += 2;
+                break;
+            }
+            resdata_c += j + 1;
+        } while (j && resdata_c < resdata_e);
+        resdata_c += 4;
+        q--;
+    }
+
+    rec = sgIP_DNS_AllocUnusedRecord();
+    if (!rec)
+        return 0;
+    nalias     = 0;
+    naddr      = 0;
+    rec->flags = SGIP_DNS_FLAG_ACTIVE | SGIP_DNS_FLAG_BUSY;
+    while (a && resdata_c < resdata_e)
+    {
+        if (nalias < SGIP_DNS_MAXALIASES)
+            sgIP_DNS_CopyAliasAt(rec->aliases[nalias++], resdata_c - responsedata);
+        do
+        {
+            j = resdata_c[0];
+            if (j > 63)
+            {
+                resdata_c += 2;
+                break;
+            }
+            resdata_c += j + 1;
+        } while (j && resdata_c < resdata_e);
+        if (resdata_c + 10 > resdata_e)
+            break; // truncated
+        // CNAME=5, A=1
+        j              = resdata_c[1];
+        rec->addrclass = (resdata_c[2] << 8) | resdata_c[3];
+        int ttl = (resdata_c[4] << 24) | (resdata_c[5] << 16) | (resdata_c[6] << 8) | resdata_c[7];
+        if (ttl < 0)
+            ttl = 0;
+        rec->expiry_time_count = time_count + ttl;
+        if (j == 1 && resdata_c + 14 <= resdata_e)
+        { // A
+            if (naddr < SGIP_DNS_MAXRECORDADDRS)
+            {
+                rec->addrdata[naddr * 4]     = resdata_c[10];
+                rec->addrdata[naddr * 4 + 1] = resdata_c[11];
+                rec->addrdata[naddr * 4 + 2] = resdata_c[12];
+                rec->addrdata[naddr * 4 + 3] = resdata_c[13];
+                naddr++;
+            }
+        }
+        j = (resdata_c[8] << 8) | resdata_c[9];
+        resdata_c += 10 + j;
+        a--;
+    }
+
+    // likely we have all the data we care for now.
+    rec->addrlen  = 4;
+    rec->numaddr  = naddr;
+    rec->numalias = nalias;
+    for (c = name, i = 0; *c; c++, i++)
+        rec->name[i] = *c;
+    rec->name[i] = 0;
+    rec->flags   = SGIP_DNS_FLAG_ACTIVE | SGIP_DNS_FLAG_RESOLVED;
+
+    if (!naddr)
+        return 0;
+    memcpy(addr, rec->addrdata, 4);
+    return 1;
+}
+
+// Returns the address of the server a lookup should ask, or 0 if there are no servers left.
+static unsigned long sgIP_DNS_LookupServer(sgIP_DNS_Lookup *l)
+{
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_GetDefaultInterface();
+    while (hw && l->server < 3)
+    {
+        if (hw->dns[l->server])
+            return hw->dns[l->server];
+        l->server++;
+    }
+    return 0;
+}
+
+// Returns the socket connected to a server, opening it if needed, or -1 on error.
+static int sgIP_DNS_ServerSocket(int server, unsigned long serverip)
+{
     struct sockaddr_in sain;
-    unsigned long IP;
-    SGIP_INTR_PROTECT();
+    int i = 1;
 
-    // is name an IP address?
-    if (sgIP_DNS_isipaddress(name, &IP))
+    if (dns_socks[server] != -1)
     {
-        SGIP_INTR_UNPROTECT();
-        return sgIP_DNS_GenerateHostentIP(IP);
+        if (dns_sockip[server] == serverip)
+            return dns_socks[server];
+        closesocket(dns_socks[server]); // the server changed
     }
 
-    // check cache, return if value required is in cache...
-    rec = sgIP_DNS_FindDNSRecord(name);
-    if (rec)
+    dns_socks[server] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (dns_socks[server] == -1)
+        return -1;
+    ioctl(dns_socks[server], FIONBIO, &i); // set non-blocking
+
+    // connected, so that an ICMP port unreachable fails the lookups over right away.
+    sain.sin_family      = AF_INET;
+    sain.sin_addr.s_addr = serverip;
+    sain.sin_port        = htons(53);
+    connect(dns_socks[server], (struct sockaddr *)&sain, sizeof(sain));
+    dns_sockip[server] = serverip;
+    return dns_socks[server];
+}
+
+// Sends the query of a lookup to its current server. Returns 0 if there is no server to ask.
+static int sgIP_DNS_SendQuery(sgIP_DNS_Lookup *l)
+{
+    struct sockaddr_in sain;
+    unsigned long serverip = sgIP_DNS_LookupServer(l);
+    if (!serverip)
+        return 0;
+    int sock = sgIP_DNS_ServerSocket(l->server, serverip);
+    if (sock == -1)
+        return 0;
+
+    int len              = sgIP_DNS_genquery(l->name, l->id);
+    sain.sin_family      = AF_INET;
+    sain.sin_addr.s_addr = serverip;
+    sain.sin_port        = htons(53);
+    sendto(sock, querydata, len, 0, (struct sockaddr *)&sain, sizeof(sain));
+    l->serverip = serverip;
+    l->sendtime = sgIP_timems;
+    return 1;
+}
+
+static void sgIP_DNS_Finish(sgIP_DNS_Lookup *l, int state)
+{
+    l->state  = state;
+    l->notify = 1;
+}
+
+// Calls the done functions of the lookups that have finished, outside of the protected section.
+// This is called from socket_run_callbacks(), so they don't run in interrupt context.
+void sgIP_DNS_RunDone(void)
+{
+    for (int n = 0; n < SGIP_DNS_MAXLOOKUPS; n++)
     {
-        he = sgIP_DNS_GenerateHostent(rec);
+        SGIP_INTR_PROTECT();
+        sgIP_DNS_Lookup *l = dnslookups + n;
+        void (*done)(int, void *) = l->notify ? l->done : NULL;
+        void *userdata            = l->userdata;
+        l->notify                 = 0;
         SGIP_INTR_UNPROTECT();
-        return he;
+        if (done)
+            done(n, userdata);
     }
+}
 
-    // not in cache? generate a query...
-    len = sgIP_DNS_genquery(name);
+// Closes the sockets once no lookup is waiting for a response.
+static void sgIP_DNS_ReleaseSockets(void)
+{
+    SGIP_INTR_PROTECT();
+    for (int n = 0; n < SGIP_DNS_MAXLOOKUPS; n++)
+    {
+        if (dnslookups[n].inuse && dnslookups[n].state == DNS_LOOKUP_PENDING)
+        {
+            SGIP_INTR_UNPROTECT();
+            return;
+        }
+    }
+    for (int n = 0; n < 3; n++)
+    {
+        if (dns_socks[n] != -1)
+        {
+            closesocket(dns_socks[n]);
+            dns_socks[n] = -1;
+        }
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
+// Moves a lookup on to the next server. It fails if there are none left.
+static void sgIP_DNS_NextServer(sgIP_DNS_Lookup *l)
+{
+    l->server++;
+    l->retries = 0;
+    if (!sgIP_DNS_SendQuery(l))
+        sgIP_DNS_Finish(l, DNS_LOOKUP_FAILED);
+}
 
-    // send off the query, handle retransmit and trying other dns servers.
-    if (dns_sock == -1)
+// Sends the queries that got no response again, moving on to the next server after
+// SGIP_DNS_MAXRETRY tries. Lookups fail when there are no servers left.
+static void sgIP_DNS_RetryLookups(void)
+{
+    SGIP_INTR_PROTECT();
+    for (int n = 0; n < SGIP_DNS_MAXLOOKUPS; n++)
     {
-        hw       = sgIP_Hub_GetDefaultInterface();
-        serverip = hw->dns[0];
+        sgIP_DNS_Lookup *l = dnslookups + n;
+        if (!l->inuse || l->state != DNS_LOOKUP_PENDING
+            || sgIP_timems - l->sendtime < SGIP_DNS_TIMEOUTMS)
+            continue;
+        if (++l->retries >= SGIP_DNS_MAXRETRY)
+            sgIP_DNS_NextServer(l);
+        else if (!sgIP_DNS_SendQuery(l))
+            sgIP_DNS_Finish(l, DNS_LOOKUP_FAILED);
+    }
+    SGIP_INTR_UNPROTECT();
 
-        dns_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sgIP_DNS_ReleaseSockets();
+}
 
-        i = 1;
-        i = ioctl(dns_sock, FIONBIO, &i); // set non-blocking
+// Receives the responses from a server and matches them to the lookups by transaction ID. If the
+// server is unreachable, the lookups waiting for it move on to the next one. Must be called
+// protected.
+static void sgIP_DNS_Receive(int server)
+{
+    struct sockaddr_in sain;
+    int len, sainlen;
+    unsigned long addr;
 
-        retries = 0;
-        do
+    int sock = dns_socks[server];
+    while (1)
+    {
+        sainlen = sizeof(sain);
+        len     = recvfrom(sock, responsedata, 512, 0, (struct sockaddr *)&sain, &sainlen);
+        if (len < 0 && errno == EWOULDBLOCK)
+            break;
+        if (len < 0)
         {
-            query_time_start     = sgIP_timems;
-            sain.sin_addr.s_addr = serverip;
-            sain.sin_port        = htons(53);
-            i = sendto(dns_sock, querydata, len, 0, (struct sockaddr *)&sain, sizeof(sain));
-dns_listenonly:
-
-            do
+            // an ICMP error, don't wait for the timeout.
+            unsigned long serverip = dns_sockip[server];
+            for (int n = 0; n < SGIP_DNS_MAXLOOKUPS; n++)
             {
-                i = recvfrom(dns_sock, responsedata, 512, 0, (struct sockaddr *)&sain, &sainlen);
-                if (i != -1)
-                    break;
-                dtime = sgIP_timems - query_time_start;
-                if (dtime > SGIP_DNS_TIMEOUTMS)
-                    break;
-                SGIP_INTR_UNPROTECT();
-                SGIP_WAITEVENT();
-                SGIP_INTR_REPROTECT();
-            } while (1);
+                sgIP_DNS_Lookup *l = dnslookups + n;
+                if (l->inuse && l->state == DNS_LOOKUP_PENDING && l->serverip == serverip)
+                    sgIP_DNS_NextServer(l);
+            }
+            if (dns_socks[server] != sock)
+                break; // the socket got closed or replaced
+            continue;
+        }
+        if (len < 12 || sain.sin_port != htons(53))
+            continue; // suspicious.
 
-            if (i == -1)
+        for (int n = 0; n < SGIP_DNS_MAXLOOKUPS; n++)
+        {
+            sgIP_DNS_Lookup *l = dnslookups + n;
+            if (!l->inuse || l->state != DNS_LOOKUP_PENDING || l->serverip != sain.sin_addr.s_addr
+                || l->id != *(unsigned short *)responsedata)
+                continue;
+            if (sgIP_DNS_ParseResponse(l->name, len, &addr))
             {
-                // no reply, retry
-                retries++;
-                if (retries >= SGIP_DNS_MAXRETRY)
-                {
-                    // maybe try another server? for now just quit.
-                    closesocket(dns_sock);
-                    dns_sock = -1;
-                    SGIP_INTR_UNPROTECT();
-
-                    return NULL;
-                }
-                continue; // send again
+                l->addr = addr;
+                sgIP_DNS_Finish(l, DNS_LOOKUP_DONE);
             }
-
-            // got something, is it what we want?
-            if (i < 12 || sain.sin_addr.s_addr != serverip || sain.sin_port != htons(53))
+            else
             {
-                // suspicious.
-
-                // yay! a goto! - go back and see if we can get a more official response.
-                goto dns_listenonly;
+                sgIP_DNS_Finish(l, DNS_LOOKUP_FAILED);
             }
+            break;
+        }
+    }
+}
 
-            // parse response.
-            {
-                const unsigned short *resdata_s = (unsigned short *)responsedata;
-                const unsigned char *resdata_c  = responsedata;
-                const char *c;
-                int j, q, a, nalias, naddr;
-                if (last_id != resdata_s[0])
-                {
-                    // bad.
-                    goto dns_listenonly;
-                }
-                q = htons(resdata_s[2]);
-                a = htons(resdata_s[3]);
-                // no answer.
-                if (a == 0)
-                {
-                    closesocket(dns_sock);
-                    dns_sock = -1;
-                    SGIP_INTR_UNPROTECT();
+// Picks up the responses to the pending lookups. Called at the end of Wifi_Update() and
+// sgIP_Timer(), once the packets have been processed.
+void sgIP_DNS_Update(void)
+{
+    SGIP_INTR_PROTECT();
+    int open = 0;
+    for (int server = 0; server < 3; server++)
+    {
+        if (dns_socks[server] != -1)
+        {
+            sgIP_DNS_Receive(server);
+            open = 1;
+        }
+    }
+    SGIP_INTR_UNPROTECT();
 
-                    return NULL;
-                }
+    if (open)
+        sgIP_DNS_ReleaseSockets();
+}
 
-                resdata_c += 12;
-                while (q)
-                {
-                    // ignore questions
-                    do
-                    {
-                        j = resdata_c[0];
-                        if (j > 63)
-                        {
-                            resdata_c += 2;
-                            break;
-                        }
-                        resdata_c += j + 1;
-                    } while (j);
-                    resdata_c += 4;
-                    q--;
-                }
+// Starts looking up name. Addresses and cached names are answered right away. Must be called
+// protected. Returns the handle of the lookup, or -1 on error.
+static int sgIP_DNS_StartLookup(const char *name, void (*done)(int, void *), void *userdata)
+{
+    sgIP_DNS_Lookup *l = NULL;
+    sgIP_DNS_Record *rec;
+    int handle;
 
-                nalias     = 0;
-                naddr      = 0;
-                rec        = sgIP_DNS_AllocUnusedRecord();
-                rec->flags = SGIP_DNS_FLAG_ACTIVE | SGIP_DNS_FLAG_BUSY;
-                while (a)
-                {
-                    if (nalias < SGIP_DNS_MAXALIASES)
-                        sgIP_DNS_CopyAliasAt(rec->aliases[nalias++], resdata_c - responsedata);
-                    do
-                    {
-                        j = resdata_c[0];
-                        if (j > 63)
-                        {
-                            resdata_c += 2;
-                            break;
-                        }
-                        resdata_c += j + 1;
-                    } while (j);
-                    // CNAME=5, A=1
-                    j              = resdata_c[1];
-                    rec->addrclass = (resdata_c[2] << 8) | resdata_c[3];
-                    int ttl = (resdata_c[4] << 24) | (resdata_c[5] << 16) | (resdata_c[6] << 8)
-                              | resdata_c[7];
-                    if (ttl < 0)
-                        ttl = 0;
-                    rec->expiry_time_count = time_count + ttl;
-                    if (j == 1)
-                    { // A
-                        if (naddr < SGIP_DNS_MAXRECORDADDRS)
-                        {
-                            rec->addrdata[naddr * 4]     = resdata_c[10];
-                            rec->addrdata[naddr * 4 + 1] = resdata_c[11];
-                            rec->addrdata[naddr * 4 + 2] = resdata_c[12];
-                            rec->addrdata[naddr * 4 + 3] = resdata_c[13];
-                            naddr++;
-                        }
-                    }
-                    j = (resdata_c[8] << 8) | resdata_c[9];
-                    resdata_c += 10 + j;
-                    a--;
-                }
+    if (strlen(name) >= sizeof(l->name))
+        return SGIP_ERROR(EINVAL);
 
-                // likely we have all the data we care for now.
-                rec->addrlen  = 4;
-                rec->numaddr  = naddr;
-                rec->numalias = nalias;
-                for (c = name, i = 0; *c; c++, i++)
-                    rec->name[i] = *c;
-                rec->name[i] = 0;
-                rec->flags   = SGIP_DNS_FLAG_ACTIVE | SGIP_DNS_FLAG_RESOLVED;
-                break; // we got our answer, let's get out of here!
-            }
-        } while (1);
+    for (handle = 0; handle < SGIP_DNS_MAXLOOKUPS; handle++)
+    {
+        if (!dnslookups[handle].inuse)
+        {
+            l = dnslookups + handle;
+            break;
+        }
+    }
+    if (!l)
+        return SGIP_ERROR(ENOMEM);
+
+    strcpy(l->name, name);
+    l->done     = done;
+    l->userdata = userdata;
+    l->notify   = 0;
+    l->server   = 0;
+    l->retries  = 0;
+    l->addr     = 0;
+
+    // is name an IP address? or is it in the cache?
+    if (sgIP_DNS_isipaddress(name, &l->addr))
+    {
+        l->inuse = 1;
+        sgIP_DNS_Finish(l, DNS_LOOKUP_DONE);
+        return handle;
+    }
+    rec = sgIP_DNS_FindDNSRecord(name);
+    if (rec && rec->numaddr)
+    {
+        memcpy(&l->addr, rec->addrdata, 4);
+        l->inuse = 1;
+        sgIP_DNS_Finish(l, DNS_LOOKUP_DONE);
+        return handle;
+    }
 
-        closesocket(dns_sock);
-        dns_sock = -1;
+    if (!sgIP_DNS_genquery(name, 0))
+        return SGIP_ERROR(EINVAL);
+
+    l->id    = htons(dns_nextid++);
+    l->state = DNS_LOOKUP_PENDING;
+    if (!sgIP_DNS_SendQuery(l))
+    {
+        sgIP_DNS_ReleaseSockets();
+        return SGIP_ERROR(ENETUNREACH); // no DNS server
     }
-    else
+    l->inuse = 1;
+    return handle;
+}
+
+sgIP_DNS_Hostent *sgIP_DNS_gethostbyname(const char *name)
+{
+    sgIP_DNS_Record *rec;
+    sgIP_DNS_Hostent *he;
+    unsigned long IP;
+    SGIP_INTR_PROTECT();
+
+    // is name an IP address?
+    if (sgIP_DNS_isipaddress(name, &IP))
+    {
+        SGIP_INTR_UNPROTECT();
+        return sgIP_DNS_GenerateHostentIP(IP);
+    }
+
+    // check cache, return if value required is in cache...
+    rec = sgIP_DNS_FindDNSRecord(name);
+    if (rec)
+    {
+        he = sgIP_DNS_GenerateHostent(rec);
+        SGIP_INTR_UNPROTECT();
+        return he;
+    }
+
+    // not in cache? wait for a lookup. Retransmits and other servers are handled by the timer.
+    int handle = sgIP_DNS_StartLookup(name, NULL, NULL);
+    if (handle == -1)
     {
         SGIP_INTR_UNPROTECT();
         return NULL;
     }
+    while (dnslookups[handle].state == DNS_LOOKUP_PENDING)
+    {
+        SGIP_INTR_WAITEVENT();
+    }
+    rec = NULL;
+    if (dnslookups[handle].state == DNS_LOOKUP_DONE)
+        rec = sgIP_DNS_FindDNSRecord(name);
+    dnslookups[handle].inuse = 0;
 
     // received response, return data
-    he = sgIP_DNS_GenerateHostent(rec);
+    he = rec ? sgIP_DNS_GenerateHostent(rec) : NULL;
     SGIP_INTR_UNPROTECT();
     return he;
 }
 
+int dns_lookup_start(const char *name, void (*done)(int handle, void *userdata), void *userdata)
+{
+    if (!name)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    int handle = sgIP_DNS_StartLookup(name, done, userdata);
+    SGIP_INTR_UNPROTECT();
+    sgIP_DNS_RunDone(); // in case it was answered right away
+    return handle;
+}
+
+int dns_lookup_poll(int handle, unsigned long *addr)
+{
+    if (handle < 0 || handle >= SGIP_DNS_MAXLOOKUPS || !dnslookups[handle].inuse)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    int state = dnslookups[handle].state;
+    if (state == DNS_LOOKUP_DONE && addr)
+        *addr = dnslookups[handle].addr;
+    SGIP_INTR_UNPROTECT();
+    return state;
+}
+
+void dns_lookup_close(int handle)
+{
+    if (handle < 0 || handle >= SGIP_DNS_MAXLOOKUPS)
+        return;
+
+    SGIP_INTR_PROTECT();
+    dnslookups[handle].inuse  = 0;
+    dnslookups[handle].notify = 0;
+    SGIP_INTR_UNPROTECT();
+    sgIP_DNS_ReleaseSockets();
+}
+
 unsigned long inet_addr(const char *cp)
 {
     unsigned long IP;
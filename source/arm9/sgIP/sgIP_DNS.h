@@ -41,6 +41,8 @@ typedef struct SGIP_DNS_HOSTENT
 
 void sgIP_DNS_Init(void);
 void sgIP_DNS_Timer1000ms(void);
+void sgIP_DNS_Update(void);
+void sgIP_DNS_RunDone(void);
 
 sgIP_DNS_Hostent *sgIP_DNS_gethostbyname(const char *name);
 sgIP_DNS_Record *sgIP_DNS_AllocUnusedRecord(void);
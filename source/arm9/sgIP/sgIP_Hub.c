@@ -16,10 +16,136 @@ int NumHWInterfaces;
 int NumProtocolInterfaces;
 sgIP_Hub_Protocol ProtocolInterfaces[SGIP_HUB_MAXPROTOCOLINTERFACES];
 sgIP_Hub_HWInterface HWInterfaces[SGIP_HUB_MAXHWINTERFACES];
+int batchdepth; // nesting level of sgIP_Hub_BeginBatch()
+
+// Packets to 127.0.0.0/8 or to one of our own addresses go through this interface. It isn't in
+// HWInterfaces, so it's never picked as the default interface.
+static sgIP_Hub_HWInterface LoopbackInterface;
+static sgIP_memblock *loopbackqueue[SGIP_HUB_LOOPBACK_QUEUE];
+static int loopbackhead, loopbackcount;
+
+static sgIP_Hub_HWInterface *rxinterface; // interface of the packet being received
+
+// Routes added with sgIP_Hub_AddRoute(). Every interface also has a route to its own network and,
+// if it has a gateway, a default route through it.
+typedef struct SGIP_HUB_ROUTE
+{
+    unsigned long dest, mask, gateway; // gateway is 0 if dest is on the same link
+    sgIP_Hub_HWInterface *hw;          // NULL if the entry is free
+} sgIP_Hub_RouteEntry;
+
+typedef struct SGIP_HUB_ROUTECACHE_ENTRY
+{
+    unsigned long dest, src, nexthop;
+    sgIP_Hub_HWInterface *hw; // NULL if the entry is unused
+    unsigned long generation;
+} sgIP_Hub_RouteCacheEntry;
+
+typedef struct SGIP_HUB_ROUTEMATCH
+{
+    sgIP_Hub_HWInterface *hw;
+    unsigned long prefix; // mask of the route in host byte order, longer prefixes compare higher
+    unsigned long nexthop;
+} sgIP_Hub_RouteMatch;
+
+static sgIP_Hub_RouteEntry routes[SGIP_HUB_MAXROUTES];
+static sgIP_Hub_RouteCacheEntry routecache[SGIP_HUB_ROUTECACHE];
+static unsigned long routegeneration; // cached lookups from other generations are stale
 
 //////////////////////////////////////////////////////////////////////////
 // Private functions
 
+static int sgIP_Hub_IsLoopbackNet(unsigned long ipaddr)
+{
+    unsigned long mask = LoopbackInterface.snmask;
+    return (ipaddr & mask) == (LoopbackInterface.ipaddr & mask);
+}
+
+// Frames aren't received right away: the sender may be in the middle of updating its state. They
+// wait in a queue for sgIP_Hub_RunLoopback().
+static int sgIP_Hub_LoopbackTransmit(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
+{
+    (void)hw;
+
+    SGIP_INTR_PROTECT();
+    if (loopbackcount == SGIP_HUB_LOOPBACK_QUEUE)
+    {
+        sgIP_memblock_free(mb);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
+    loopbackqueue[(loopbackhead + loopbackcount++) % SGIP_HUB_LOOPBACK_QUEUE] = mb;
+    SGIP_INTR_UNPROTECT();
+    SGIP_WAKEEVENT(); // a waiting thread will receive it
+    return 0;
+}
+
+// Keeps the route if it leads to dest_address and is more specific than the best one so far.
+static void sgIP_Hub_MatchRoute(sgIP_Hub_RouteMatch *best, unsigned long dest_address,
+                                unsigned long dest, unsigned long mask, unsigned long gateway,
+                                sgIP_Hub_HWInterface *hw)
+{
+    if ((dest_address & mask) != (dest & mask))
+        return;
+    if (best->hw && ntohl(mask) <= best->prefix)
+        return;
+    best->hw      = hw;
+    best->prefix  = ntohl(mask);
+    best->nexthop = gateway ? gateway : dest_address;
+}
+
+static sgIP_Hub_HWInterface *sgIP_Hub_LookupRoute(unsigned long dest_address,
+                                                  unsigned long src_address,
+                                                  unsigned long *nexthop)
+{
+    if (sgIP_Hub_IsLoopback(dest_address))
+    {
+        *nexthop = dest_address;
+        return &LoopbackInterface;
+    }
+
+    // packets from one of our addresses have to leave through the interface that owns it.
+    sgIP_Hub_HWInterface *srchw = NULL;
+    for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
+    {
+        if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE)
+            && HWInterfaces[n].ipaddr == src_address)
+        {
+            srchw = HWInterfaces + n;
+            break;
+        }
+    }
+    if (!srchw && src_address)
+        return NULL;
+
+    if (dest_address == 0xFFFFFFFF) // broadcast address, send directly.
+    {
+        *nexthop = dest_address;
+        return srchw ? srchw : sgIP_Hub_GetDefaultInterface();
+    }
+
+    // longest prefix match. Added routes come first, so they win over the implicit ones.
+    sgIP_Hub_RouteMatch best = { NULL, 0, 0 };
+    for (int n = 0; n < SGIP_HUB_MAXROUTES; n++)
+    {
+        sgIP_Hub_RouteEntry *r = routes + n;
+        if (r->hw && (!srchw || r->hw == srchw))
+            sgIP_Hub_MatchRoute(&best, dest_address, r->dest, r->mask, r->gateway, r->hw);
+    }
+    for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
+    {
+        sgIP_Hub_HWInterface *hw = HWInterfaces + n;
+        if (!(hw->flags & SGIP_FLAG_HWINTERFACE_IN_USE) || (srchw && hw != srchw))
+            continue;
+        if (hw->ipaddr || hw == srchw) // an unconfigured interface only sends what's bound to it
+            sgIP_Hub_MatchRoute(&best, dest_address, hw->ipaddr, hw->snmask, 0, hw);
+        if (hw->gateway)
+            sgIP_Hub_MatchRoute(&best, dest_address, 0, 0, hw->gateway, hw);
+    }
+    *nexthop = best.nexthop;
+    return best.hw;
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Public functions
 
@@ -27,6 +153,14 @@ void sgIP_Hub_Init(void)
 {
     NumHWInterfaces       = 0;
     NumProtocolInterfaces = 0;
+
+    LoopbackInterface.flags = SGIP_FLAG_HWINTERFACE_IN_USE | SGIP_FLAG_HWINTERFACE_CONNECTED
+                              | SGIP_FLAG_HWINTERFACE_ENABLED;
+    LoopbackInterface.MTU              = SGIP_MTU_OVERRIDE;
+    LoopbackInterface.offload          = SGIP_HWOFFLOAD_TXCHECKSUM | SGIP_HWOFFLOAD_RXCHECKSUM;
+    LoopbackInterface.TransmitFunction = &sgIP_Hub_LoopbackTransmit;
+    LoopbackInterface.ipaddr           = htonl(0x7F000001); // 127.0.0.1
+    LoopbackInterface.snmask           = htonl(0xFF000000);
 }
 
 sgIP_Hub_Protocol *sgIP_Hub_AddProtocolInterface(int protocolID,
@@ -72,11 +206,14 @@ sgIP_Hub_HWInterface *sgIP_Hub_AddHardwareInterface(int (*TransmitFunction)(sgIP
 
     HWInterfaces[n].flags            = SGIP_FLAG_HWINTERFACE_IN_USE | SGIP_FLAG_HWINTERFACE_ENABLED;
     HWInterfaces[n].TransmitFunction = TransmitFunction;
+    HWInterfaces[n].FlushFunction    = 0;
+    HWInterfaces[n].offload          = 0;
 
     if (InterfaceInit)
         InterfaceInit(HWInterfaces + n);
 
     NumHWInterfaces++;
+    sgIP_Hub_RoutesChanged();
     return HWInterfaces + n;
 }
 
@@ -108,6 +245,13 @@ void sgIP_Hub_RemoveHardwareInterface(sgIP_Hub_HWInterface *hw)
 
     hw->flags = 0;
     NumHWInterfaces--;
+
+    for (n = 0; n < SGIP_HUB_MAXROUTES; n++)
+    {
+        if (routes[n].hw == hw)
+            routes[n].hw = NULL;
+    }
+    sgIP_Hub_RoutesChanged();
 }
 
 int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet)
@@ -141,7 +285,11 @@ int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *pack
                 && ProtocolInterfaces[n].protocol == protocol)
             {
                 // this protocol handler
-                return ProtocolInterfaces[n].ReceivePacket(packet);
+                sgIP_Hub_HWInterface *prev = rxinterface;
+                rxinterface                = hw;
+                int retval                 = ProtocolInterfaces[n].ReceivePacket(packet);
+                rxinterface                = prev;
+                return retval;
             }
         }
     }
@@ -150,41 +298,122 @@ int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *pack
     return 0;
 }
 
-// send packet from a protocol interface, resolve the requisite hardware interface addresses and
-// send it.
-int sgIP_Hub_SendProtocolPacket(int protocol, sgIP_memblock *packet, unsigned long dest_address,
-                                unsigned long src_address)
+// Finds the interface to send a packet to dest_address from src_address (0 for any of ours) and
+// the address of the next hop (dest_address itself if it's on the same link, or a gateway).
+// Returns NULL if there's no route.
+sgIP_Hub_HWInterface *sgIP_Hub_Route(unsigned long dest_address, unsigned long src_address,
+                                     unsigned long *nexthop)
 {
-    if (!packet)
-        return 0;
+    unsigned long hash = dest_address ^ (dest_address >> 16);
+    hash               = (hash ^ (hash >> 8)) & 0xFF;
+
+    SGIP_INTR_PROTECT();
+    sgIP_Hub_RouteCacheEntry *c = routecache + hash % SGIP_HUB_ROUTECACHE;
+    if (!c->hw || c->generation != routegeneration || c->dest != dest_address
+        || c->src != src_address)
+    {
+        c->hw         = sgIP_Hub_LookupRoute(dest_address, src_address, &c->nexthop);
+        c->dest       = dest_address;
+        c->src        = src_address;
+        c->generation = routegeneration;
+    }
+    sgIP_Hub_HWInterface *hw = c->hw;
+    *nexthop                 = c->nexthop;
+    SGIP_INTR_UNPROTECT();
+    return hw;
+}
 
-    sgIP_Hub_HWInterface *hw = NULL;
+// Adds a route to the network dest/mask through gateway (0 if it's on the link of hw), or
+// replaces the route to that network. Returns 0, or -1 if the table is full.
+int sgIP_Hub_AddRoute(unsigned long dest, unsigned long mask, unsigned long gateway,
+                      sgIP_Hub_HWInterface *hw)
+{
+    if (!hw)
+        return SGIP_ERROR(EINVAL);
 
-    // figure out what hardware interface is in use.
-    for (int i = 0; i < SGIP_HUB_MAXHWINTERFACES; i++)
+    SGIP_INTR_PROTECT();
+    sgIP_Hub_RouteEntry *r = NULL;
+    for (int n = 0; n < SGIP_HUB_MAXROUTES; n++)
     {
-        if (HWInterfaces[i].ipaddr == src_address)
+        if (routes[n].hw && routes[n].dest == (dest & mask) && routes[n].mask == mask)
         {
-            hw = HWInterfaces + i;
+            r = routes + n;
             break;
         }
+        if (!routes[n].hw && !r)
+            r = routes + n;
     }
+    if (!r)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(ENOMEM);
+    }
+    r->dest    = dest & mask;
+    r->mask    = mask;
+    r->gateway = gateway;
+    r->hw      = hw;
+    sgIP_Hub_RoutesChanged();
+    SGIP_INTR_UNPROTECT();
+    return 0;
+}
 
+void sgIP_Hub_RemoveRoute(unsigned long dest, unsigned long mask)
+{
+    SGIP_INTR_PROTECT();
+    for (int n = 0; n < SGIP_HUB_MAXROUTES; n++)
+    {
+        if (routes[n].hw && routes[n].dest == (dest & mask) && routes[n].mask == mask)
+            routes[n].hw = NULL;
+    }
+    sgIP_Hub_RoutesChanged();
+    SGIP_INTR_UNPROTECT();
+}
+
+// Must be called after changing the addresses, network mask or gateway of an interface.
+void sgIP_Hub_RoutesChanged(void)
+{
+    routegeneration++;
+    sgIP_ARP_generation++; // next hops cached by the protocols may have changed too
+}
+
+// Returns the SGIP_HWOFFLOAD_* flags of the interface that packets to dest_address go through.
+unsigned short sgIP_Hub_RouteOffload(unsigned long dest_address, unsigned long src_address)
+{
+    unsigned long nexthop;
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_Route(dest_address, src_address, &nexthop);
+    return hw ? hw->offload : 0;
+}
+
+// Returns the SGIP_HWOFFLOAD_* flags of the interface the packet being received came from.
+unsigned short sgIP_Hub_ReceiveOffload(void)
+{
+    return rxinterface ? rxinterface->offload : 0;
+}
+
+// send packet from a protocol interface, resolve the requisite hardware interface addresses and
+// send it.
+int sgIP_Hub_SendProtocolPacket(int protocol, sgIP_memblock *packet, unsigned long dest_address,
+                                unsigned long src_address)
+{
+    if (!packet)
+        return 0;
+
+    unsigned long nexthop;
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_Route(dest_address, src_address, &nexthop);
     if (!hw)
     {
         sgIP_memblock_free(packet);
         return 0;
     }
-    // resolve protocol address to hardware address & send packet
-    if ((src_address & hw->snmask) == (dest_address & hw->snmask) // on same network
-        || dest_address == 0xFFFFFFFF) // or broadcast address, send directly.
+    if (hw == &LoopbackInterface)
     {
-        return sgIP_ARP_SendProtocolFrame(hw, packet, protocol, dest_address);
-    }
-    else
-    { // eek, on different network. Send to gateway
-        return sgIP_ARP_SendProtocolFrame(hw, packet, protocol, hw->gateway);
+        // no hardware address to resolve, the header only has to say what protocol it is.
+        sgIP_memblock_exposeheader(packet, 14);
+        ((sgIP_Header_Ethernet *)packet->datastart)->protocol = protocol;
+        return sgIP_Hub_SendRawPacket(hw, packet);
     }
+    // resolve protocol address to hardware address & send packet
+    return sgIP_ARP_SendProtocolFrame(hw, packet, protocol, nexthop);
 }
 
 // send packet on a hardware interface.
@@ -200,38 +429,124 @@ int sgIP_Hub_SendRawPacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet)
     return 0;
 }
 
-int sgIP_Hub_IPMaxMessageSize(unsigned long ipaddr)
+// Packets sent between sgIP_Hub_BeginBatch() and sgIP_Hub_EndBatch() are queued by interfaces that
+// have a FlushFunction, and only handed to the hardware once at the end. Batches may be nested.
+void sgIP_Hub_BeginBatch(void)
 {
-    (void)ipaddr;
-
-    return SGIP_MTU_OVERRIDE; // hack - make this more accurate soon!
+    SGIP_INTR_PROTECT();
+    batchdepth++;
+    SGIP_INTR_UNPROTECT();
 }
 
-unsigned long sgIP_Hub_GetCompatibleIP(unsigned long destIP)
+void sgIP_Hub_EndBatch(void)
 {
-    for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
+    SGIP_INTR_PROTECT();
+    if (batchdepth > 0 && --batchdepth == 0)
     {
-        if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE))
+        for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
         {
-            if ((HWInterfaces[n].ipaddr & HWInterfaces[n].snmask)
-                == (destIP & HWInterfaces[n].snmask))
-                return HWInterfaces[n].ipaddr;
+            if (HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_FLUSHPENDING)
+            {
+                HWInterfaces[n].flags &= ~SGIP_FLAG_HWINTERFACE_FLUSHPENDING;
+                HWInterfaces[n].FlushFunction(HWInterfaces + n);
+            }
         }
     }
+    SGIP_INTR_UNPROTECT();
+}
 
+// Called by a TransmitFunction after queueing a packet. Returns 1 if it shouldn't start the
+// transmission now because a batch is in progress.
+int sgIP_Hub_DeferFlush(sgIP_Hub_HWInterface *hw)
+{
+    if (!batchdepth || !hw->FlushFunction)
+        return 0;
+    hw->flags |= SGIP_FLAG_HWINTERFACE_FLUSHPENDING;
+    return 1;
+}
+
+// Returns 1 if packets to ipaddr stay on this machine.
+int sgIP_Hub_IsLoopback(unsigned long ipaddr)
+{
+    if (sgIP_Hub_IsLoopbackNet(ipaddr))
+        return 1;
     for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
     {
-        if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE))
+        if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE) && HWInterfaces[n].ipaddr
+            && HWInterfaces[n].ipaddr == ipaddr)
+            return 1;
+    }
+    return 0;
+}
+
+// Returns 1 while a packet from the loopback interface is being received, so the protocols can
+// skip checks that only matter for packets that went over a network.
+int sgIP_Hub_ReceivingLoopback(void)
+{
+    return rxinterface == &LoopbackInterface;
+}
+
+// Receives the packets waiting on the loopback interface. This must only be called when the stack
+// isn't in the middle of something: from the timer, after the hardware interfaces are serviced,
+// or when a thread is about to wait. Returns the number of packets received.
+int sgIP_Hub_RunLoopback(void)
+{
+    int count = 0;
+    SGIP_INTR_PROTECT();
+    // replies sent while receiving are picked up by the loop below
+    if (!sgIP_Hub_ReceivingLoopback())
+    {
+        while (loopbackcount)
         {
-            return HWInterfaces[n].ipaddr;
+            sgIP_memblock *mb = loopbackqueue[loopbackhead];
+            loopbackhead      = (loopbackhead + 1) % SGIP_HUB_LOOPBACK_QUEUE;
+            loopbackcount--;
+
+            sgIP_Hub_ReceiveHardwarePacket(&LoopbackInterface, mb);
+            count++;
         }
     }
+    SGIP_INTR_UNPROTECT();
+    return count;
+}
 
-    return 0;
+int sgIP_Hub_IPMaxMessageSize(unsigned long ipaddr)
+{
+    unsigned long nexthop;
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_Route(ipaddr, sgIP_Hub_GetCompatibleIP(ipaddr), &nexthop);
+    if (hw && hw->MTU > 0 && hw->MTU < SGIP_MTU_OVERRIDE)
+        return hw->MTU;
+    return SGIP_MTU_OVERRIDE;
+}
+
+// Returns the address of the interface that packets to destIP are sent through.
+unsigned long sgIP_Hub_GetCompatibleIP(unsigned long destIP)
+{
+    if (sgIP_Hub_IsLoopbackNet(destIP))
+        return LoopbackInterface.ipaddr;
+
+    unsigned long nexthop;
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_Route(destIP, 0, &nexthop);
+    if (hw == &LoopbackInterface)
+        return destIP; // one of our own addresses
+    if (!hw)
+        hw = sgIP_Hub_GetDefaultInterface();
+    return hw ? hw->ipaddr : 0;
 }
 
+// Returns the interface of the default route, or the first one if there's no default route.
 sgIP_Hub_HWInterface *sgIP_Hub_GetDefaultInterface(void)
 {
+    for (int n = 0; n < SGIP_HUB_MAXROUTES; n++)
+    {
+        if (routes[n].hw && routes[n].mask == 0)
+            return routes[n].hw;
+    }
+    for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
+    {
+        if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE) && HWInterfaces[n].gateway)
+            return HWInterfaces + n;
+    }
     for (int n = 0; n < SGIP_HUB_MAXHWINTERFACES; n++)
     {
         if ((HWInterfaces[n].flags & SGIP_FLAG_HWINTERFACE_IN_USE))
@@ -21,8 +21,13 @@ extern "C" {
 #define SGIP_FLAG_HWINTERFACE_CONNECTED     0x0002
 #define SGIP_FLAG_HWINTERFACE_USEDHCP       0x0004
 #define SGIP_FLAG_HWINTERFACE_CHANGENETWORK 0x0008
+#define SGIP_FLAG_HWINTERFACE_FLUSHPENDING  0x0010 // packets queued during a batch, not flushed
 #define SGIP_FLAG_HWINTERFACE_ENABLED       0x8000
 
+// Offload flags of a hardware interface
+#define SGIP_HWOFFLOAD_TXCHECKSUM 0x0001 // sent packets don't need TCP/UDP checksums
+#define SGIP_HWOFFLOAD_RXCHECKSUM 0x0002 // checksums of received packets are already verified
+
 #ifdef SGIP_LITTLEENDIAN
 #    define PROTOCOL_ETHER_ARP 0x0608
 #    define PROTOCOL_ETHER_IP  0x0008
@@ -46,7 +51,10 @@ typedef struct SGIP_HUB_HWINTERFACE
     unsigned short flags;
     unsigned short hwaddrlen;
     int MTU;
+    unsigned short offload; // SGIP_HWOFFLOAD_*
     int (*TransmitFunction)(struct SGIP_HUB_HWINTERFACE *, sgIP_memblock *);
+    // Optional. Starts transmission of packets queued by TransmitFunction during a batch.
+    void (*FlushFunction)(struct SGIP_HUB_HWINTERFACE *);
     void *userdata;
     unsigned long ipaddr, gateway, snmask, dns[3];
     unsigned char hwaddr[SGIP_MAXHWADDRLEN];
@@ -74,10 +82,26 @@ void sgIP_Hub_RemoveProtocolInterface(sgIP_Hub_Protocol *protocol);
 void sgIP_Hub_RemoveHardwareInterface(sgIP_Hub_HWInterface *hw);
 
 int sgIP_Hub_ReceiveHardwarePacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet);
+sgIP_Hub_HWInterface *sgIP_Hub_Route(unsigned long dest_address, unsigned long src_address,
+                                     unsigned long *nexthop);
+int sgIP_Hub_AddRoute(unsigned long dest, unsigned long mask, unsigned long gateway,
+                      sgIP_Hub_HWInterface *hw);
+void sgIP_Hub_RemoveRoute(unsigned long dest, unsigned long mask);
+void sgIP_Hub_RoutesChanged(void);
+unsigned short sgIP_Hub_RouteOffload(unsigned long dest_address, unsigned long src_address);
+unsigned short sgIP_Hub_ReceiveOffload(void);
 int sgIP_Hub_SendProtocolPacket(int protocol, sgIP_memblock *packet, unsigned long dest_address,
                                 unsigned long src_address);
 int sgIP_Hub_SendRawPacket(sgIP_Hub_HWInterface *hw, sgIP_memblock *packet);
 
+void sgIP_Hub_BeginBatch(void);
+void sgIP_Hub_EndBatch(void);
+int sgIP_Hub_DeferFlush(sgIP_Hub_HWInterface *hw);
+
+int sgIP_Hub_IsLoopback(unsigned long ipaddr);
+int sgIP_Hub_ReceivingLoopback(void);
+int sgIP_Hub_RunLoopback(void);
+
 int sgIP_Hub_IPMaxMessageSize(unsigned long ipaddr);
 unsigned long sgIP_Hub_GetCompatibleIP(unsigned long destIP);
 
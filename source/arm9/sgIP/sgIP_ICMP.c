@@ -4,14 +4,264 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <sys/ping.h>
+
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_ICMP.h"
 #include "arm9/sgIP/sgIP_IP.h"
+#include "arm9/sgIP/sgIP_TCP.h"
+#include "arm9/sgIP/sgIP_UDP.h"
+
+extern volatile unsigned long sgIP_timems;
+
+#define SGIP_ICMP_PING_ID 0x7300 // echo identifier of target n is SGIP_ICMP_PING_ID + n
+
+typedef struct SGIP_ICMP_PINGTARGET
+{
+    unsigned long addr; // 0 if the handle is unused
+    unsigned short nextseq;
+    unsigned long outstanding;                     // bit n: request nextseq - 1 - n is waiting
+    unsigned long sendtime[SGIP_ICMP_PING_WINDOW]; // indexed by sequence number
+    ping_stats stats;
+    unsigned long rtt_total;
+} sgIP_ICMP_PingTarget;
+
+static sgIP_ICMP_PingTarget pingtargets[SGIP_ICMP_PING_MAXTARGETS];
 
 void sgIP_ICMP_Init(void)
 {
 }
 
+// Counts the requests that have waited too long as lost.
+static void sgIP_ICMP_PingExpire(sgIP_ICMP_PingTarget *t)
+{
+    for (int n = 0; n < SGIP_ICMP_PING_WINDOW; n++)
+    {
+        if (!(t->outstanding & (1UL << n)))
+            continue;
+        unsigned short seq = t->nextseq - 1 - n;
+        if (sgIP_timems - t->sendtime[seq % SGIP_ICMP_PING_WINDOW] >= SGIP_ICMP_PING_TIMEOUTMS)
+        {
+            t->outstanding &= ~(1UL << n);
+            t->stats.lost++;
+        }
+    }
+}
+
+static void sgIP_ICMP_EchoReply(sgIP_memblock *mb, unsigned long srcip)
+{
+    sgIP_Header_ICMP *icmp = (sgIP_Header_ICMP *)mb->datastart;
+    int n                  = htons(((unsigned short *)&icmp->xtra)[0]) - SGIP_ICMP_PING_ID;
+    unsigned short seq     = htons(((unsigned short *)&icmp->xtra)[1]);
+    if (n < 0 || n >= SGIP_ICMP_PING_MAXTARGETS)
+        return;
+
+    SGIP_INTR_PROTECT();
+    sgIP_ICMP_PingTarget *t = pingtargets + n;
+    int age                 = (unsigned short)(t->nextseq - 1 - seq);
+    if (t->addr == srcip && age < SGIP_ICMP_PING_WINDOW && (t->outstanding & (1UL << age)))
+    {
+        int rtt = sgIP_timems - t->sendtime[seq % SGIP_ICMP_PING_WINDOW];
+        if (rtt < SGIP_ICMP_PING_TIMEOUTMS)
+        {
+            t->outstanding &= ~(1UL << age);
+            t->stats.received++;
+            t->rtt_total += rtt;
+            t->stats.rtt_last = rtt;
+            t->stats.rtt_avg  = t->rtt_total / t->stats.received;
+            if (t->stats.rtt_min < 0 || rtt < t->stats.rtt_min)
+                t->stats.rtt_min = rtt;
+            if (rtt > t->stats.rtt_max)
+                t->stats.rtt_max = rtt;
+        }
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
+int ping_open(unsigned long addr)
+{
+    if (addr == 0)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    for (int n = 0; n < SGIP_ICMP_PING_MAXTARGETS; n++)
+    {
+        sgIP_ICMP_PingTarget *t = pingtargets + n;
+        if (t->addr)
+            continue;
+        t->addr           = addr;
+        t->nextseq        = 0;
+        t->outstanding    = 0;
+        t->rtt_total      = 0;
+        t->stats.sent     = 0;
+        t->stats.received = 0;
+        t->stats.lost     = 0;
+        t->stats.rtt_last = -1;
+        t->stats.rtt_min  = -1;
+        t->stats.rtt_avg  = -1;
+        t->stats.rtt_max  = -1;
+        SGIP_INTR_UNPROTECT();
+        return n;
+    }
+    SGIP_INTR_UNPROTECT();
+    return SGIP_ERROR(ENOMEM);
+}
+
+int ping_send(int handle, int datalen)
+{
+    if (handle < 0 || handle >= SGIP_ICMP_PING_MAXTARGETS || datalen < 4
+        || datalen > 0xFFFF - 8 - sgIP_IP_RequiredHeaderSize())
+        return SGIP_ERROR(EINVAL);
+
+    sgIP_memblock *mb = sgIP_memblock_alloc(sgIP_IP_RequiredHeaderSize() + 8 + datalen);
+    if (!mb)
+        return SGIP_ERROR(ENOMEM);
+    sgIP_memblock_exposeheader(mb, -sgIP_IP_RequiredHeaderSize());
+
+    SGIP_INTR_PROTECT();
+    sgIP_ICMP_PingTarget *t = pingtargets + handle;
+    if (!t->addr)
+    {
+        SGIP_INTR_UNPROTECT();
+        sgIP_memblock_free(mb);
+        return SGIP_ERROR(EINVAL);
+    }
+    sgIP_ICMP_PingExpire(t);
+    if (t->outstanding & (1UL << (SGIP_ICMP_PING_WINDOW - 1)))
+        t->stats.lost++; // about to fall out of the window
+    t->outstanding = ((t->outstanding << 1) | 1) & ((1UL << SGIP_ICMP_PING_WINDOW) - 1);
+    t->stats.sent++;
+
+    unsigned short seq = t->nextseq++;
+    unsigned long now  = sgIP_timems;
+    t->sendtime[seq % SGIP_ICMP_PING_WINDOW] = now;
+
+    // the payload starts with the time it was sent, the rest is a pattern.
+    unsigned char data[32];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = i;
+    sgIP_memblock_CopyFromLinear(mb, &now, 8, 4);
+    for (int ofs = 4; ofs < datalen; ofs += sizeof(data))
+        sgIP_memblock_CopyFromLinear(mb, data, 8 + ofs, sizeof(data));
+
+    sgIP_Header_ICMP *icmp             = (sgIP_Header_ICMP *)mb->datastart;
+    icmp->type                         = 8; // echo request
+    icmp->code                         = 0;
+    icmp->checksum                     = 0;
+    ((unsigned short *)&icmp->xtra)[0] = htons(SGIP_ICMP_PING_ID + handle);
+    ((unsigned short *)&icmp->xtra)[1] = htons(seq);
+    icmp->checksum                     = ~sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
+
+    unsigned long addr = t->addr;
+    sgIP_IP_SendViaIP(mb, PROTOCOL_IP_ICMP, sgIP_IP_GetLocalBindAddr(0, addr), addr);
+    SGIP_INTR_UNPROTECT();
+    return seq;
+}
+
+int ping_getstats(int handle, ping_stats *stats)
+{
+    if (handle < 0 || handle >= SGIP_ICMP_PING_MAXTARGETS || !stats)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    sgIP_ICMP_PingTarget *t = pingtargets + handle;
+    if (!t->addr)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+    sgIP_ICMP_PingExpire(t);
+    *stats         = t->stats;
+    stats->pending = 0;
+    for (int n = 0; n < SGIP_ICMP_PING_WINDOW; n++)
+    {
+        if (t->outstanding & (1UL << n))
+            stats->pending++;
+    }
+    SGIP_INTR_UNPROTECT();
+    return 0;
+}
+
+void ping_close(int handle)
+{
+    if (handle >= 0 && handle < SGIP_ICMP_PING_MAXTARGETS)
+        pingtargets[handle].addr = 0;
+}
+
+// Routers older than RFC 1191 don't report the next hop MTU. Try the next lower of the common
+// MTUs (RFC 1191 section 7) instead.
+static int sgIP_ICMP_MTUPlateau(int length)
+{
+    static const unsigned short plateaus[] = {
+        32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, 68,
+    };
+    for (unsigned int i = 0; i < sizeof(plateaus) / sizeof(plateaus[0]); i++)
+    {
+        if (plateaus[i] < length)
+            return plateaus[i];
+    }
+    return 68;
+}
+
+// Destination unreachable and time exceeded messages quote the IP header and the first 8 bytes
+// of the packet that caused them, which is enough to find the socket that sent it.
+static void sgIP_ICMP_ReceiveError(sgIP_memblock *mb)
+{
+    sgIP_Header_ICMP *icmp = (sgIP_Header_ICMP *)mb->datastart;
+    if (mb->thislength < 8 + 20)
+        return;
+    sgIP_Header_IP *iphdr = (sgIP_Header_IP *)(mb->datastart + 8);
+    int hdrlen            = (iphdr->version_ihl & 15) * 4;
+    if (hdrlen < 20 || mb->thislength < 8 + hdrlen)
+        return;
+
+    if (icmp->type == 3 && icmp->code == 4)
+    {
+        // fragmentation needed and DF set: the router tells us the MTU of the next hop.
+        int mtu = htons(((unsigned short *)&icmp->xtra)[1]);
+        if (mtu == 0)
+            mtu = sgIP_ICMP_MTUPlateau(htons(iphdr->tot_length));
+        sgIP_IP_SetPathMTU(iphdr->dest_address, mtu);
+        return;
+    }
+
+    int error = EHOSTUNREACH;
+    if (icmp->type == 3)
+    {
+        switch (icmp->code)
+        {
+            case 0:  // network unreachable
+            case 6:  // destination network unknown
+            case 11: // network unreachable for type of service
+                error = ENETUNREACH;
+                break;
+            case 2: // protocol unreachable
+            case 3: // port unreachable
+                error = ECONNREFUSED;
+                break;
+        }
+    }
+
+    struct
+    {
+        unsigned short srcport, destport;
+        unsigned long seq; // TCP only
+    } quote;
+    if (sgIP_memblock_CopyToLinear(mb, &quote, 8 + hdrlen, 8) != 8)
+        return;
+
+    if (iphdr->protocol == PROTOCOL_IP_TCP)
+    {
+        sgIP_TCP_ICMPError(iphdr->src_address, quote.srcport, iphdr->dest_address, quote.destport,
+                           htonl(quote.seq), error);
+    }
+    else if (iphdr->protocol == PROTOCOL_IP_UDP)
+    {
+        sgIP_UDP_ICMPError(iphdr->src_address, quote.srcport, iphdr->dest_address, quote.destport,
+                           error);
+    }
+}
+
 int sgIP_ICMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip)
 {
     if (!mb)
@@ -35,7 +285,15 @@ int sgIP_ICMP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned lon
             icmp->checksum = ~sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
             return sgIP_IP_SendViaIP(mb, PROTOCOL_IP_ICMP, destip, srcip);
 
-        case 0:  // echo reply (ignore for now)
+        case 3:  // destination unreachable
+        case 11: // time exceeded
+            sgIP_ICMP_ReceiveError(mb);
+            break;
+
+        case 0: // echo reply
+            sgIP_ICMP_EchoReply(mb, srcip);
+            break;
+
         default: // others (ignore for now)
             break;
     }
@@ -10,8 +10,252 @@
 #include "arm9/sgIP/sgIP_TCP.h"
 #include "arm9/sgIP/sgIP_UDP.h"
 
+extern volatile unsigned long sgIP_timems;
+
 int idnum_count;
 
+// A packet that is being reassembled. Its fragments are kept sorted by offset.
+typedef struct SGIP_IP_REASSEMBLY
+{
+    unsigned long src_address;
+    unsigned long dest_address;
+    unsigned short identification;
+    unsigned char protocol;
+    unsigned char numfrags;   // 0 if the entry is unused
+    int total_length;         // length of the payload, or -1 until the last fragment arrives
+    int received;             // payload bytes received
+    int bytes;                // memblock bytes held, counting the IP headers
+    unsigned long time_start; // sgIP_timems when the first fragment arrived
+
+    sgIP_memblock *frag[SGIP_IP_REASSEMBLY_MAXFRAGMENTS];
+    unsigned short frag_offset[SGIP_IP_REASSEMBLY_MAXFRAGMENTS]; // in bytes, in the payload
+    unsigned short frag_length[SGIP_IP_REASSEMBLY_MAXFRAGMENTS]; // in bytes, without header
+} sgIP_IP_Reassembly;
+
+static sgIP_IP_Reassembly reassembly[SGIP_IP_REASSEMBLY_MAXPACKETS];
+static int reassembly_bytes; // memblock bytes held by all entries
+
+typedef struct SGIP_IP_PMTU
+{
+    unsigned long dest_address;
+    int mtu;                // 0 if the entry is unused
+    unsigned long time_set; // sgIP_timems when the MTU was learnt
+} sgIP_IP_PMTU;
+
+static sgIP_IP_PMTU pmtu_cache[SGIP_IP_PMTU_MAXENTRIES];
+
+static void sgIP_IP_ReassemblyDrop(sgIP_IP_Reassembly *r)
+{
+    for (int i = 0; i < r->numfrags; i++)
+        sgIP_memblock_free(r->frag[i]);
+    reassembly_bytes -= r->bytes;
+    r->numfrags = 0;
+    r->bytes    = 0;
+}
+
+// Returns the oldest entry in use other than skip, or 0 if there isn't one.
+static sgIP_IP_Reassembly *sgIP_IP_ReassemblyOldest(sgIP_IP_Reassembly *skip)
+{
+    sgIP_IP_Reassembly *oldest = 0;
+    for (int i = 0; i < SGIP_IP_REASSEMBLY_MAXPACKETS; i++)
+    {
+        sgIP_IP_Reassembly *r = reassembly + i;
+        if (!r->numfrags || r == skip)
+            continue;
+        if (!oldest || (long)(r->time_start - oldest->time_start) < 0)
+            oldest = r;
+    }
+    return oldest;
+}
+
+// Links the fragments of a complete packet into one memblock chain. The IP header of the first
+// fragment is kept, and updated to describe the whole packet.
+static sgIP_memblock *sgIP_IP_ReassemblyFinish(sgIP_IP_Reassembly *r)
+{
+    sgIP_memblock *first = r->frag[0];
+    sgIP_memblock *last  = first;
+    int totallength      = first->totallength - r->frag_length[0] + r->total_length;
+
+    for (int i = 1; i < r->numfrags; i++)
+    {
+        sgIP_memblock *mb = r->frag[i];
+        sgIP_memblock_exposeheader(mb, r->frag_length[i] - mb->totallength); // hide the header
+        while (last->next)
+            last = last->next;
+        last->next = mb;
+    }
+    for (last = first; last; last = last->next)
+        last->totallength = totallength;
+
+    sgIP_Header_IP *iphdr  = (sgIP_Header_IP *)first->datastart;
+    iphdr->tot_length      = htons(totallength);
+    iphdr->fragment_offset = 0;
+
+    reassembly_bytes -= r->bytes;
+    r->numfrags = 0;
+    r->bytes    = 0;
+    return first;
+}
+
+// Checks that the first fragment of a packet holds the whole transport header (with TCP options),
+// as the upper layers only read it from the first memblock of the reassembled chain (RFC 1858).
+static int sgIP_IP_FirstFragmentOK(sgIP_memblock *mb, int hdrlen)
+{
+    sgIP_Header_IP *iphdr = (sgIP_Header_IP *)mb->datastart;
+    unsigned char *data   = (unsigned char *)mb->datastart + hdrlen;
+    int avail             = mb->thislength - hdrlen;
+    switch (iphdr->protocol)
+    {
+        case PROTOCOL_IP_TCP:
+            return avail >= 20 && avail >= (data[12] >> 4) * 4;
+        case PROTOCOL_IP_UDP:
+        case PROTOCOL_IP_ICMP:
+            return avail >= 8;
+    }
+    return 1;
+}
+
+// Takes a fragment and returns the whole packet if it was the last one missing, or 0 if the packet
+// isn't complete yet (or the fragment was dropped).
+static sgIP_memblock *sgIP_IP_Reassemble(sgIP_memblock *mb)
+{
+    sgIP_Header_IP *iphdr = (sgIP_Header_IP *)mb->datastart;
+    int hdrlen            = (iphdr->version_ihl & 15) * 4;
+    int flags             = htons(iphdr->fragment_offset);
+    int offset            = (flags & SGIP_IP_FRAGOFFSET_MASK) * 8;
+    int length            = mb->totallength - hdrlen;
+    int more              = flags & SGIP_IP_FLAG_MF;
+
+    // all fragments but the last carry a multiple of 8 bytes, and the packet can't go over 64KB.
+    if (length <= 0 || (more && (length & 7)) || hdrlen + offset + length > 0xFFFF
+        || mb->totallength > SGIP_IP_REASSEMBLY_MAXBYTES
+        || (offset == 0 && !sgIP_IP_FirstFragmentOK(mb, hdrlen)))
+    {
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
+    SGIP_INTR_PROTECT();
+    sgIP_IP_Reassembly *r      = 0;
+    sgIP_IP_Reassembly *unused = 0;
+    for (int i = 0; i < SGIP_IP_REASSEMBLY_MAXPACKETS; i++)
+    {
+        sgIP_IP_Reassembly *e = reassembly + i;
+        if (!e->numfrags)
+        {
+            if (!unused)
+                unused = e;
+        }
+        else if (e->identification == iphdr->identification && e->protocol == iphdr->protocol
+                 && e->src_address == iphdr->src_address && e->dest_address == iphdr->dest_address)
+        {
+            r = e;
+            break;
+        }
+    }
+    if (!r)
+    {
+        r = unused;
+        if (!r)
+        {
+            r = sgIP_IP_ReassemblyOldest(0);
+            sgIP_IP_ReassemblyDrop(r);
+        }
+        r->src_address    = iphdr->src_address;
+        r->dest_address   = iphdr->dest_address;
+        r->identification = iphdr->identification;
+        r->protocol       = iphdr->protocol;
+        r->total_length   = -1;
+        r->received       = 0;
+        r->bytes          = 0;
+        r->time_start     = sgIP_timems;
+    }
+
+    // find where the fragment goes; it must not overlap the others.
+    int pos = 0;
+    while (pos < r->numfrags && r->frag_offset[pos] <= offset)
+        pos++;
+    if (pos > 0 && r->frag_offset[pos - 1] == offset && r->frag_length[pos - 1] == length)
+    {
+        // retransmitted fragment, we already have it.
+        sgIP_memblock_free(mb);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
+    int end = offset + length;
+    if ((pos > 0 && r->frag_offset[pos - 1] + r->frag_length[pos - 1] > offset)
+        || (pos < r->numfrags && end > r->frag_offset[pos])
+        || r->numfrags == SGIP_IP_REASSEMBLY_MAXFRAGMENTS
+        || (r->total_length >= 0 && (end > r->total_length || (!more && end != r->total_length)))
+        || (!more && pos < r->numfrags))
+    {
+        // overlapping or inconsistent fragments, give up on the whole packet.
+        SGIP_DEBUG_MESSAGE(("IP: bad fragment"));
+        sgIP_IP_ReassemblyDrop(r);
+        sgIP_memblock_free(mb);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
+
+    // make room for the fragment, dropping the oldest other packets if needed.
+    while (reassembly_bytes + mb->totallength > SGIP_IP_REASSEMBLY_MAXBYTES)
+    {
+        sgIP_IP_Reassembly *oldest = sgIP_IP_ReassemblyOldest(r);
+        if (!oldest)
+            break;
+        sgIP_IP_ReassemblyDrop(oldest);
+    }
+    if (reassembly_bytes + mb->totallength > SGIP_IP_REASSEMBLY_MAXBYTES)
+    {
+        sgIP_IP_ReassemblyDrop(r);
+        sgIP_memblock_free(mb);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
+
+    for (int i = r->numfrags; i > pos; i--)
+    {
+        r->frag[i]        = r->frag[i - 1];
+        r->frag_offset[i] = r->frag_offset[i - 1];
+        r->frag_length[i] = r->frag_length[i - 1];
+    }
+    r->frag[pos]        = mb;
+    r->frag_offset[pos] = offset;
+    r->frag_length[pos] = length;
+    r->numfrags++;
+    r->received += length;
+    r->bytes += mb->totallength;
+    reassembly_bytes += mb->totallength;
+    if (!more)
+        r->total_length = end;
+
+    mb = 0;
+    if (r->received == r->total_length)
+        mb = sgIP_IP_ReassemblyFinish(r);
+    SGIP_INTR_UNPROTECT();
+    return mb;
+}
+
+void sgIP_IP_Timer1000ms(void)
+{
+    SGIP_INTR_PROTECT();
+    for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+    {
+        if (pmtu_cache[i].mtu && sgIP_timems - pmtu_cache[i].time_set >= SGIP_IP_PMTU_TIMEOUTMS)
+            pmtu_cache[i].mtu = 0;
+    }
+    for (int i = 0; i < SGIP_IP_REASSEMBLY_MAXPACKETS; i++)
+    {
+        sgIP_IP_Reassembly *r = reassembly + i;
+        if (r->numfrags && sgIP_timems - r->time_start >= SGIP_IP_REASSEMBLY_TIMEOUTMS)
+        {
+            SGIP_DEBUG_MESSAGE(("IP: reassembly timed out"));
+            sgIP_IP_ReassemblyDrop(r);
+        }
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
 int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
 {
     sgIP_Header_IP *iphdr;
@@ -40,8 +284,19 @@ int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
         return 0; // bad version.
     }
 
-    // check checksum
-    chksum_temp = sgIP_memblock_IPChecksum(mb, 0, hdrlen * 4);
+    // 127.0.0.0/8 only exists on the loopback interface.
+    if (!sgIP_Hub_ReceivingLoopback()
+        && ((ntohl(iphdr->src_address) >> 24) == 127 || (ntohl(iphdr->dest_address) >> 24) == 127))
+    {
+        SGIP_DEBUG_MESSAGE(("IP: loopback address from the network!"));
+        sgIP_memblock_free(mb);
+        return 0;
+    }
+
+    // check checksum, unless the interface already did
+    chksum_temp = 0xFFFF;
+    if (!(sgIP_Hub_ReceiveOffload() & SGIP_HWOFFLOAD_RXCHECKSUM))
+        chksum_temp = sgIP_memblock_IPChecksum(mb, 0, hdrlen * 4);
     if (chksum_temp != 0xFFFF)
     {
         // bad chksum! kill packet.
@@ -49,12 +304,14 @@ int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
         sgIP_memblock_free(mb);
         return 0; // bad checksum.
     }
-    if (htons(iphdr->fragment_offset) & 0x3FFF)
+    if (htons(iphdr->fragment_offset) & (SGIP_IP_FLAG_MF | SGIP_IP_FRAGOFFSET_MASK))
     {
-        // fragmented! oh noes! We can't deal with this!
-        SGIP_DEBUG_MESSAGE(("IP: fragmented!"));
-        sgIP_memblock_free(mb);
-        return 0; // fragmented.
+        // fragmented, hold on to it until the rest of the packet arrives.
+        mb = sgIP_IP_Reassemble(mb);
+        if (!mb)
+            return 0;
+        iphdr  = (sgIP_Header_IP *)mb->datastart;
+        hdrlen = iphdr->version_ihl & 15;
     }
 
     sgIP_memblock_exposeheader(mb, -hdrlen * 4);
@@ -78,7 +335,55 @@ int sgIP_IP_ReceivePacket(sgIP_memblock *mb)
 
 int sgIP_IP_MaxContentsSize(unsigned long destip)
 {
-    return sgIP_Hub_IPMaxMessageSize(destip) - sgIP_IP_RequiredHeaderSize();
+    return sgIP_IP_PathMTU(destip) - sgIP_IP_RequiredHeaderSize();
+}
+
+// Largest IP packet that can be sent to destip without being fragmented on the way.
+int sgIP_IP_PathMTU(unsigned long destip)
+{
+    int mtu = sgIP_Hub_IPMaxMessageSize(destip);
+    for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+    {
+        if (pmtu_cache[i].mtu && pmtu_cache[i].dest_address == destip)
+        {
+            if (pmtu_cache[i].mtu < mtu)
+                mtu = pmtu_cache[i].mtu;
+            break;
+        }
+    }
+    return mtu;
+}
+
+// Called when a router reports that a packet to destip was too big. Only decreases are taken,
+// increases are found when the entry times out.
+void sgIP_IP_SetPathMTU(unsigned long destip, int mtu)
+{
+    if (mtu < SGIP_IP_PMTU_MIN)
+        mtu = SGIP_IP_PMTU_MIN;
+
+    SGIP_INTR_PROTECT();
+    if (mtu >= sgIP_IP_PathMTU(destip))
+    {
+        SGIP_INTR_UNPROTECT();
+        return;
+    }
+    sgIP_IP_PMTU *e = 0;
+    for (int i = 0; i < SGIP_IP_PMTU_MAXENTRIES; i++)
+    {
+        sgIP_IP_PMTU *t = pmtu_cache + i;
+        if (t->mtu && t->dest_address == destip)
+        {
+            e = t;
+            break;
+        }
+        if (!e || (e->mtu && (!t->mtu || (long)(t->time_set - e->time_set) < 0)))
+            e = t; // prefer unused entries, then the oldest one
+    }
+    SGIP_DEBUG_MESSAGE(("IP: path MTU %i", mtu));
+    e->dest_address = destip;
+    e->mtu          = mtu;
+    e->time_set     = sgIP_timems;
+    SGIP_INTR_UNPROTECT();
 }
 
 int sgIP_IP_RequiredHeaderSize(void)
@@ -86,16 +391,17 @@ int sgIP_IP_RequiredHeaderSize(void)
     return 5 * 4; // we'll not include zeroed options.
 }
 
-int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip)
+static void sgIP_IP_WriteHeader(sgIP_memblock *mb, int protocol, unsigned long srcip,
+                                unsigned long destip, int identification, int fragment_offset)
 {
     sgIP_memblock_exposeheader(mb, 20);
 
     sgIP_Header_IP *iphdr       = (sgIP_Header_IP *)mb->datastart;
     unsigned short *chksum_calc = (unsigned short *)mb->datastart;
     iphdr->dest_address         = destip;
-    iphdr->fragment_offset      = 0;
+    iphdr->fragment_offset      = htons(fragment_offset);
     iphdr->header_checksum      = 0;
-    iphdr->identification       = idnum_count++;
+    iphdr->identification       = identification;
     iphdr->protocol             = protocol;
     iphdr->src_address          = srcip;
     iphdr->tot_length           = htons(mb->totallength);
@@ -114,6 +420,56 @@ int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsi
         chksum_temp = 0xFFFF;
 
     iphdr->header_checksum = chksum_temp;
+}
+
+// Adds an IP header in front of the data in the memblock.
+void sgIP_IP_BuildHeader(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip)
+{
+    // TCP sizes its segments from the path MTU, so ask routers to tell us if they are too big
+    // instead of fragmenting them.
+    int flags = protocol == PROTOCOL_IP_TCP ? SGIP_IP_FLAG_DF : 0;
+    sgIP_IP_WriteHeader(mb, protocol, srcip, destip, idnum_count++, flags);
+}
+
+// Splits a packet that doesn't fit in the path MTU into fragments and sends them.
+static int sgIP_IP_SendFragments(sgIP_memblock *mb, int protocol, unsigned long srcip,
+                                 unsigned long destip, int mtu)
+{
+    int hdrlen   = sgIP_IP_RequiredHeaderSize();
+    int fragsize = (mtu - hdrlen) & ~7; // all fragments but the last carry a multiple of 8 bytes
+    int id       = idnum_count++;
+
+    sgIP_Hub_BeginBatch();
+    for (int ofs = 0; ofs < mb->totallength; ofs += fragsize)
+    {
+        int len   = mb->totallength - ofs;
+        int flags = ofs >> 3;
+        if (len > fragsize)
+        {
+            len = fragsize;
+            flags |= SGIP_IP_FLAG_MF;
+        }
+        sgIP_memblock *frag = sgIP_memblock_alloc(hdrlen + len);
+        if (!frag)
+            break; // the packet can't be reassembled without this fragment anyway.
+        sgIP_memblock_exposeheader(frag, -hdrlen);
+        sgIP_memblock_CopyBlock(mb, frag, ofs, 0, len);
+        sgIP_IP_WriteHeader(frag, protocol, srcip, destip, id, flags);
+        sgIP_Hub_SendProtocolPacket(htons(0x0800), frag, destip, srcip);
+    }
+    sgIP_Hub_EndBatch();
+
+    sgIP_memblock_free(mb);
+    return 0;
+}
+
+int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip)
+{
+    int mtu = sgIP_IP_PathMTU(destip);
+    if (protocol != PROTOCOL_IP_TCP && mb->totallength + sgIP_IP_RequiredHeaderSize() > mtu)
+        return sgIP_IP_SendFragments(mb, protocol, srcip, destip, mtu);
+
+    sgIP_IP_BuildHeader(mb, protocol, srcip, destip);
     return sgIP_Hub_SendProtocolPacket(htons(0x0800), mb, destip, srcip);
 }
 
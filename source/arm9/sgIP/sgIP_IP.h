@@ -17,6 +17,11 @@ extern "C" {
 #define PROTOCOL_IP_TCP  6
 #define PROTOCOL_IP_UDP  17
 
+// Flags in the fragment_offset field
+#define SGIP_IP_FLAG_DF         0x4000 // don't fragment
+#define SGIP_IP_FLAG_MF         0x2000 // more fragments
+#define SGIP_IP_FRAGOFFSET_MASK 0x1FFF
+
 typedef struct SGIP_HEADER_IP
 {
     // version = top 4 bits == 4, IHL = header length in 32bit increments = bottom 4 bits
@@ -42,8 +47,12 @@ typedef struct SGIP_HEADER_IP
 } sgIP_Header_IP;
 
 int sgIP_IP_ReceivePacket(sgIP_memblock *mb);
+void sgIP_IP_Timer1000ms(void);
 int sgIP_IP_MaxContentsSize(unsigned long destip);
+int sgIP_IP_PathMTU(unsigned long destip);
+void sgIP_IP_SetPathMTU(unsigned long destip, int mtu);
 int sgIP_IP_RequiredHeaderSize(void);
+void sgIP_IP_BuildHeader(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip);
 int sgIP_IP_SendViaIP(sgIP_memblock *mb, int protocol, unsigned long srcip, unsigned long destip);
 unsigned long sgIP_IP_GetLocalBindAddr(unsigned long srcip, unsigned long destip);
 
@@ -4,26 +4,46 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <netinet/tcp.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_TCP.h"
+#include "arm9/sgIP/sgIP_portalloc.h"
+#include "arm9/sgIP/sgIP_sockets.h"
 
 sgIP_Record_TCP *tcprecords;
-int port_counter;
+sgIP_PortAlloc tcpports;
+unsigned int tcpports_bitmap[SGIP_PORTALLOC_WORDS(SGIP_TCP_FIRSTOUTGOINGPORT,
+                                                  SGIP_TCP_LASTOUTGOINGPORT)];
 unsigned long lasttime;
 extern volatile unsigned long sgIP_timems;
+extern unsigned long sgIP_Random(void);
 sgIP_TCP_SYNCookie synlist[SGIP_TCP_MAXSYNS];
+sgIP_TCP_TimeWait timewaitlist[SGIP_TCP_MAXTIMEWAIT];
 
-int numsynlist; // number of active entries in synlist (earliest first)
+int numsynlist;  // number of active entries in synlist (earliest first)
+int numtimewait; // number of active entries in timewaitlist (unordered)
+
+#ifdef SGIP_TCP_FASTOPEN
+sgIP_TCP_FastOpenCookie tfocache[SGIP_TCP_FASTOPEN_MAXCOOKIES];
+unsigned long tfosecret[4]; // key for the cookies we hand out, see sgIP_TCP_SetFastOpen()
+#endif
 
 void sgIP_TCP_Init(void)
 {
     tcprecords   = 0;
     numsynlist   = 0;
-    port_counter = SGIP_TCP_FIRSTOUTGOINGPORT;
+    numtimewait  = 0;
     lasttime     = sgIP_timems;
+    sgIP_portalloc_Init(&tcpports, tcpports_bitmap, SGIP_TCP_FIRSTOUTGOINGPORT,
+                        SGIP_TCP_LASTOUTGOINGPORT);
+#ifdef SGIP_TCP_FASTOPEN
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_MAXCOOKIES; i++)
+        tfocache[i].len = 0;
+#endif
 }
 
 // scan through tcp records and resend anything necessary
@@ -46,9 +66,7 @@ void sgIP_TCP_Timer(void)
             else
                 synlist[i].timenext = synlist[i].timebackoff - j;
             // resend SYN
-            sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, synlist[i].localseq,
-                                  synlist[i].remoteseq, synlist[i].localip, synlist[i].remoteip,
-                                  synlist[i].localport, synlist[i].remoteport, -1);
+            sgIP_TCP_SendSynAck(&synlist[i]);
         }
         else
         {
@@ -56,10 +74,23 @@ void sgIP_TCP_Timer(void)
         }
     }
 
+    for (i = 0; i < numtimewait; i++)
+    {
+        if ((int)(sgIP_timems - timewaitlist[i].expiry) >= 0)
+        {
+            // 2MSL have passed, forget about this connection.
+            if (timewaitlist[i].port_reserved)
+                sgIP_portalloc_Release(&tcpports, ntohs(timewaitlist[i].localport));
+            timewaitlist[i] = timewaitlist[--numtimewait]; // assume struct copy
+            i--;
+        }
+    }
+
     sgIP_Record_TCP *rec = tcprecords;
     while (rec)
     {
-        time = sgIP_timems - rec->time_last_action;
+        int oldstate = rec->tcpstate;
+        time         = sgIP_timems - rec->time_last_action;
         switch (rec->tcpstate)
         {
             case SGIP_TCP_STATE_NODATA:     // newly allocated [do nothing]
@@ -76,7 +107,7 @@ void sgIP_TCP_Timer(void)
                     if (rec->retrycount >= SGIP_TCP_MAXRETRY)
                     {
                         // error
-                        rec->errorcode = ECONNABORTED;
+                        rec->errorcode = ETIMEDOUT;
                         rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
                         break;
                     }
@@ -86,6 +117,31 @@ void sgIP_TCP_Timer(void)
                         j = SGIP_TCP_BACKOFFMAX;
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_SYN, 0);
                     rec->time_backoff = j; // preserve backoff
+                    rec->stats.total_retrans++;
+                }
+                break;
+
+            case SGIP_TCP_STATE_SYN_RECEIVED: // spawned from listen socket [resend syn-ack]
+                if (time > rec->time_backoff)
+                {
+                    rec->retrycount++;
+                    if (rec->retrycount >= SGIP_TCP_MAXRETRY)
+                    {
+                        // error
+                        rec->errorcode = ETIMEDOUT;
+                        rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                        break;
+                    }
+                    j = rec->time_backoff;
+                    j *= 2;
+                    if (j > SGIP_TCP_BACKOFFMAX)
+                        j = SGIP_TCP_BACKOFFMAX;
+                    sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, rec->sequence - 1,
+                                          rec->ack, rec->srcip, rec->destip, rec->srcport,
+                                          rec->destport, -1);
+                    rec->time_last_action = sgIP_timems;
+                    rec->time_backoff     = j;
+                    rec->stats.total_retrans++;
                 }
                 break;
 
@@ -173,6 +229,7 @@ void sgIP_TCP_Timer(void)
                         j = SGIP_TCP_BACKOFFMAX;
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_FIN, 0);
                     rec->time_backoff = j; // preserve backoff
+                    rec->stats.total_retrans++;
                 }
                 break;
 
@@ -194,18 +251,12 @@ void sgIP_TCP_Timer(void)
                         j = SGIP_TCP_BACKOFFMAX;
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_FIN | SGIP_TCP_FLAG_ACK, 0);
                     rec->time_backoff = j; // preserve backoff
-                }
-                break;
-
-            case SGIP_TCP_STATE_TIME_WAIT:
-                // wait to ensure remote tcp knows it's been terminated. [reset in 2MSL]
-                if (time > SGIP_TCP_TIMEMS_2MSL)
-                {
-                    rec->errorcode = ESHUTDOWN;
-                    rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                    rec->stats.total_retrans++;
                 }
                 break;
         }
+        if (rec->tcpstate != oldstate)
+            sgIP_sockets_Notify(rec->socket);
 
         rec = rec->next;
     }
@@ -223,35 +274,240 @@ unsigned long sgIP_TCP_support_seqhash(unsigned long srcip, unsigned long destip
     return hash;
 }
 
+// Returns a free port in host byte order, or 0 if they are all in use. The port must be released
+// with sgIP_portalloc_Release() when the record that uses it is done with it.
 int sgIP_TCP_GetUnusedOutgoingPort(void)
 {
-    int myport, clear;
-    sgIP_Record_TCP *rec;
-    port_counter += (sgIP_timems & 1023); // semi-random
+    return sgIP_portalloc_Get(&tcpports);
+}
 
-    if (port_counter > SGIP_TCP_LASTOUTGOINGPORT)
-        port_counter = SGIP_TCP_FIRSTOUTGOINGPORT;
+// Takes a round trip time sample for the segment being timed, smoothed as per RFC 6298 (in ms).
+void sgIP_TCP_support_rttsample(sgIP_Record_TCP *rec)
+{
+    int rtt = sgIP_timems - rec->stats.rtt_start;
+    if (rec->stats.srtt == 0)
+    {
+        rec->stats.srtt   = rtt;
+        rec->stats.rttvar = rtt / 2;
+    }
+    else
+    {
+        int err = rtt - rec->stats.srtt;
+        if (err < 0)
+            err = -err;
+        rec->stats.rttvar = (3 * rec->stats.rttvar + err) / 4;
+        rec->stats.srtt   = (7 * rec->stats.srtt + rtt) / 8;
+    }
+    if (rec->stats.srtt == 0)
+        rec->stats.srtt = 1; // 0 means not measured
+    rec->stats.rtt_timing = 0;
+}
 
-    while (1)
+// Returns a pointer to the first TCP option of the given kind in the header of mb, or 0.
+unsigned char *sgIP_TCP_support_findoption(sgIP_memblock *mb, int kind)
+{
+    sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)mb->datastart;
+    int hdrlen           = (tcp->dataofs_ >> 4) * 4;
+    if (hdrlen > mb->thislength)
+        return 0;
+
+    unsigned char *opt = (unsigned char *)mb->datastart + 20;
+    unsigned char *end = (unsigned char *)mb->datastart + hdrlen;
+    while (opt < end)
     {
-        rec    = tcprecords;
-        myport = port_counter++;
-        if (port_counter > SGIP_TCP_LASTOUTGOINGPORT)
-            port_counter = SGIP_TCP_FIRSTOUTGOINGPORT;
-        clear = 1;
-        while (rec)
+        if (opt[0] == SGIP_TCP_OPTION_END)
+            break;
+        if (opt[0] == SGIP_TCP_OPTION_NOP)
         {
-            if (rec->srcport == myport && rec->tcpstate != SGIP_TCP_STATE_CLOSED
-                && rec->tcpstate != SGIP_TCP_STATE_NODATA)
-            {
-                clear = 0;
-                break;
-            }
-            rec = rec->next;
+            opt++;
+            continue;
         }
-        if (clear)
-            return myport;
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break; // malformed
+        if (opt[0] == kind)
+            return opt;
+        opt += opt[1];
     }
+    return 0;
+}
+
+#ifdef SGIP_TCP_FASTOPEN
+
+unsigned long sgIP_TCP_support_tfomix(unsigned long x)
+{
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+// Generates the cookie (SGIP_TCP_FASTOPEN_COOKIELEN bytes) we give to the client at remoteip.
+void sgIP_TCP_support_tfocookie(unsigned long remoteip, unsigned char *cookie)
+{
+    unsigned long x, y;
+    x = sgIP_TCP_support_tfomix(remoteip ^ tfosecret[0]);
+    x = sgIP_TCP_support_tfomix(x + tfosecret[1]);
+    y = sgIP_TCP_support_tfomix(x ^ tfosecret[3]);
+    y = sgIP_TCP_support_tfomix(y + tfosecret[0]);
+
+    x ^= tfosecret[2];
+    y ^= tfosecret[1];
+    for (int i = 0; i < 4; i++)
+    {
+        cookie[i]     = x >> (i * 8);
+        cookie[i + 4] = y >> (i * 8);
+    }
+}
+
+// Writes a TFO option carrying len bytes of cookie (0 for a cookie request) to opt, padded with
+// NOPs to a multiple of 4 bytes. Returns the number of bytes written.
+int sgIP_TCP_support_tfooption(unsigned char *opt, const unsigned char *cookie, int len)
+{
+    int optlen = (len + 2 + 3) & ~3;
+    int i      = 0;
+    while (i < optlen - len - 2)
+        opt[i++] = SGIP_TCP_OPTION_NOP;
+    opt[i++] = SGIP_TCP_OPTION_FASTOPEN;
+    opt[i++] = len + 2;
+    for (int j = 0; j < len; j++)
+        opt[i++] = cookie[j];
+    return optlen;
+}
+
+sgIP_TCP_FastOpenCookie *sgIP_TCP_FastOpenLookup(unsigned long remoteip)
+{
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_MAXCOOKIES; i++)
+    {
+        if (tfocache[i].len && tfocache[i].remoteip == remoteip)
+            return &tfocache[i];
+    }
+    return 0;
+}
+
+void sgIP_TCP_FastOpenStore(unsigned long remoteip, const unsigned char *cookie, int len)
+{
+    if (len < 4 || len > SGIP_TCP_FASTOPEN_MAXCOOKIELEN)
+        return; // RFC 7413 cookies are 4 to 16 bytes.
+
+    sgIP_TCP_FastOpenCookie *c = sgIP_TCP_FastOpenLookup(remoteip);
+    if (!c)
+    {
+        // take a free entry, or the least recently used one.
+        c = &tfocache[0];
+        for (int i = 0; i < SGIP_TCP_FASTOPEN_MAXCOOKIES && c->len; i++)
+        {
+            if (!tfocache[i].len || (int)(tfocache[i].lastused - c->lastused) < 0)
+                c = &tfocache[i];
+        }
+    }
+    c->remoteip = remoteip;
+    c->lastused = sgIP_timems;
+    c->len      = len;
+    for (int i = 0; i < len; i++)
+        c->cookie[i] = cookie[i];
+}
+
+// Builds the TFO option for an outgoing SYN: our cached cookie if there is data to send on the
+// SYN, or a cookie request if we don't have one for this server yet.
+int sgIP_TCP_FastOpenSynOption(unsigned long remoteip, unsigned char *opt, int datalength)
+{
+    sgIP_TCP_FastOpenCookie *c = sgIP_TCP_FastOpenLookup(remoteip);
+    if (!c)
+        return sgIP_TCP_support_tfooption(opt, 0, 0);
+    if (datalength <= 0)
+        return 0;
+    c->lastused = sgIP_timems;
+    return sgIP_TCP_support_tfooption(opt, c->cookie, c->len);
+}
+
+// Checks the TFO cookie option on an incoming SYN against the one we'd give to that client.
+int sgIP_TCP_FastOpenCheckCookie(unsigned char *opt, unsigned long remoteip)
+{
+    unsigned char cookie[SGIP_TCP_FASTOPEN_COOKIELEN];
+    if (opt[1] != SGIP_TCP_FASTOPEN_COOKIELEN + 2)
+        return 0;
+    sgIP_TCP_support_tfocookie(remoteip, cookie);
+    for (int i = 0; i < SGIP_TCP_FASTOPEN_COOKIELEN; i++)
+    {
+        if (opt[i + 2] != cookie[i])
+            return 0;
+    }
+    return 1;
+}
+
+// A SYN with a valid cookie came in on a listening connection: create the connection right away
+// (skipping the SYN list), take the data that came with the SYN and put it in the listen queue.
+// Data the application sends on it still waits for the handshake to complete.
+// Returns 0 if the connection can't be created, the SYN should then get the regular treatment.
+int sgIP_TCP_FastOpenAccept(sgIP_Record_TCP *listenrec, sgIP_memblock *mb, unsigned long srcip,
+                            unsigned long destip)
+{
+    sgIP_Header_TCP *tcp = (sgIP_Header_TCP *)mb->datastart;
+    int datastart        = (tcp->dataofs_ >> 4) * 4;
+    int datalen          = mb->totallength - datastart;
+    int j;
+
+    if (datalen <= 0 || datalen >= SGIP_TCP_RECEIVEBUFFERLENGTH)
+        return 0;
+    for (j = 0; j < listenrec->maxlisten; j++)
+        if (!listenrec->listendata[j])
+            break; // find last entry in listen queue
+    if (j == listenrec->maxlisten)
+        return 0;
+
+    sgIP_Record_TCP *rec = sgIP_TCP_AllocRecord();
+    if (!rec)
+        return 0;
+    listenrec->listendata[j] = rec;
+    if (j + 1 != listenrec->maxlisten)
+        listenrec->listendata[j + 1] = 0;
+
+    unsigned long myseq = sgIP_TCP_support_seqhash(srcip, destip, tcp->srcport, tcp->destport);
+
+    // fill in data about the connection.
+    rec->tcpstate         = SGIP_TCP_STATE_SYN_RECEIVED;
+    rec->time_last_action = sgIP_timems;
+    rec->time_backoff     = SGIP_TCP_SYNRETRYMS; // backoff timer
+    rec->srcip            = destip;
+    rec->destip           = srcip;
+    rec->srcport          = tcp->destport;
+    rec->destport         = tcp->srcport;
+    rec->sequence         = myseq + 1; // our SYN takes one sequence number
+    rec->ack              = htonl(tcp->seqnum) + 1 + datalen;
+    rec->sequence_next    = rec->sequence;
+    rec->rxwindow         = rec->ack + 1400; // last byte in receive window
+    rec->txwindow         = rec->sequence + htons(tcp->window);
+
+    sgIP_memblock_CopyToLinear(mb, rec->buf_rx, datastart, datalen);
+    rec->buf_rx_out = datalen;
+    rec->stats.segs_in++;
+    rec->stats.bytes_received += datalen;
+
+    sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, myseq, rec->ack, rec->srcip,
+                          rec->destip, rec->srcport, rec->destport, -1);
+    return 1;
+}
+
+#endif // SGIP_TCP_FASTOPEN
+
+// Sends (or resends) the SYN-ACK for an entry of the SYN list.
+void sgIP_TCP_SendSynAck(sgIP_TCP_SYNCookie *syn)
+{
+    unsigned char opt[SGIP_TCP_FASTOPEN_COOKIELEN + 4];
+    int optlen = 0;
+#ifdef SGIP_TCP_FASTOPEN
+    if (syn->fastopen)
+    {
+        unsigned char cookie[SGIP_TCP_FASTOPEN_COOKIELEN];
+        sgIP_TCP_support_tfocookie(syn->remoteip, cookie);
+        optlen = sgIP_TCP_support_tfooption(opt, cookie, SGIP_TCP_FASTOPEN_COOKIELEN);
+    }
+#endif
+    sgIP_TCP_SendSynReplyOpt(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, syn->localseq, syn->remoteseq,
+                             syn->localip, syn->remoteip, syn->localport, syn->remoteport, -1,
+                             opt, optlen);
 }
 
 int sgIP_TCP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
@@ -260,9 +516,6 @@ int sgIP_TCP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long
     if (!mb)
         return 0;
 
-    if (mb->totallength & 1)
-        mb->datastart[mb->totallength] = 0;
-
     int checksum = sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
     // add in checksum of "faux header"
     checksum += (destip & 0xFFFF);
@@ -294,7 +547,7 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     // SGIP_DEBUG_MESSAGE(("-L%04X,C%04X,F%02X,h%X,A%08X", mb->totallength, tcp->checksum,
     //                    tcp->tcpflags, tcp->dataofs_ >> 4, tcp->acknum));
 
-    if (tcp->checksum != 0x0000
+    if (tcp->checksum != 0x0000 && !(sgIP_Hub_ReceiveOffload() & SGIP_HWOFFLOAD_RXCHECKSUM)
         && sgIP_TCP_CalcChecksum(mb, srcip, destip, mb->totallength) != 0xFFFF)
     {
         // checksum is invalid!
@@ -307,7 +560,8 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     // find associated block.
     while (rec)
     {
-        if (rec->srcport == tcp->destport && (rec->srcip == destip || rec->srcip == 0))
+        if (rec->srcport == tcp->destport && (rec->srcip == destip || rec->srcip == 0)
+            && rec->tcpstate != SGIP_TCP_STATE_CLOSED)
         {
             if ((rec->tcpstate == SGIP_TCP_STATE_LISTEN && (tcp->tcpflags & SGIP_TCP_FLAG_SYN))
                 || rec->destport == tcp->srcport)
@@ -318,6 +572,37 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
 
     if (!rec)
     {
+        // could be a late segment of a connection in TIME_WAIT?
+        int i;
+        for (i = 0; i < numtimewait; i++)
+        {
+            if (timewaitlist[i].localport == tcp->destport
+                && timewaitlist[i].remoteport == tcp->srcport
+                && timewaitlist[i].localip == destip && timewaitlist[i].remoteip == srcip)
+                break;
+        }
+        if (i < numtimewait)
+        {
+            if (tcp->tcpflags & SGIP_TCP_FLAG_RST)
+            {
+                // they're done with it too.
+                if (timewaitlist[i].port_reserved)
+                    sgIP_portalloc_Release(&tcpports, ntohs(timewaitlist[i].localport));
+                timewaitlist[i] = timewaitlist[--numtimewait]; // assume struct copy
+            }
+            else if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
+            {
+                // our last ACK got lost, send it again and restart the 2MSL timer.
+                sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_ACK, timewaitlist[i].localseq,
+                                      timewaitlist[i].remoteseq, timewaitlist[i].localip,
+                                      timewaitlist[i].remoteip, timewaitlist[i].localport,
+                                      timewaitlist[i].remoteport, 0);
+                timewaitlist[i].expiry = sgIP_timems + SGIP_TCP_TIMEMS_2MSL;
+            }
+            sgIP_memblock_free(mb);
+            return 0;
+        }
+
         // could be completion of an incoming connection?
         tcpack = htonl(tcp->acknum);
         if (tcp->tcpflags & SGIP_TCP_FLAG_ACK)
@@ -347,6 +632,7 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                     j++;
                     if (j != rec->maxlisten)
                         rec->listendata[j] = 0;
+                    sgIP_sockets_Notify(rec->socket); // something to accept
 
                     rec = rec->listendata[j - 1];
 
@@ -386,8 +672,23 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     tcpseq      = htonl(tcp->seqnum);
     datalen     = mb->totallength - (tcp->dataofs_ >> 4) * 4;
     shouldReply = 0;
+    rec->stats.segs_in++;
     if (tcp->tcpflags & SGIP_TCP_FLAG_RST) // verify if rst is legit, and act on it.
     {
+        if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT)
+        {
+            // nothing to check the sequence against yet, it's legit if it acks our SYN.
+            delta1 = (int)(tcpack - rec->sequence - 1);
+            delta2 = (int)(rec->sequence_next - rec->sequence);
+            if ((tcp->tcpflags & SGIP_TCP_FLAG_ACK) && delta1 >= 0 && delta1 <= delta2)
+            {
+                rec->errorcode = ECONNREFUSED;
+                rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+                sgIP_sockets_Notify(rec->socket);
+            }
+            sgIP_memblock_free(mb);
+            return 0;
+        }
         // check seq against receive window
         delta1 = (int)(tcpseq - rec->ack);
         delta2 = (int)(rec->rxwindow - tcpseq);
@@ -400,6 +701,7 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             // in range! reset connection.
             rec->errorcode = ECONNRESET;
             rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+            sgIP_sockets_Notify(rec->socket);
         }
         sgIP_memblock_free(mb);
         return 0;
@@ -417,6 +719,17 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             sgIP_memblock_free(mb);
             return 0;
         }
+        if (delta1 > 0)
+        {
+            rec->stats.bytes_acked += delta1;
+            if (rec->stats.rtt_timing && (int)(tcpack - rec->stats.rtt_seq) >= 0)
+                sgIP_TCP_support_rttsample(rec);
+        }
+        else if (datalen == 0 && !(tcp->tcpflags & SGIP_TCP_FLAG_FIN)
+                 && rec->sequence != rec->sequence_next)
+        {
+            rec->stats.dup_acks++; // nothing new acked while we have data in flight
+        }
         delta2        = tcpack - rec->sequence;
         rec->sequence = tcpack;
         delta2 += rec->buf_tx_in;
@@ -463,6 +776,8 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
 
                 if (delta1 < 0 || delta2 < 0 || delta3 < 0)
                 {
+                    if (delta3 < 0 && datalen > 0)
+                        rec->stats.ooo_segs++;
                     if (delta1 > -SGIP_TCP_RECEIVEBUFFERLENGTH)
                     {
                         // ack it anyway, they got lost on the retard bus.
@@ -481,6 +796,7 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                     }
                     // copy data into the fifo
                     rec->ack += datalen;
+                    rec->stats.bytes_received += datalen;
                     delta1 = datalen;
                     while (datalen > 0)
                     {
@@ -535,6 +851,22 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             if (tcp->tcpflags & SGIP_TCP_FLAG_SYN)
             {
                 // other end requesting a connection
+                int fastopen = 0;
+#ifdef SGIP_TCP_FASTOPEN
+                if (rec->fastopen)
+                {
+                    unsigned char *opt =
+                        sgIP_TCP_support_findoption(mb, SGIP_TCP_OPTION_FASTOPEN);
+                    if (opt)
+                    {
+                        if (sgIP_TCP_FastOpenCheckCookie(opt, srcip)
+                            && sgIP_TCP_FastOpenAccept(rec, mb, srcip, destip))
+                            break;
+                        // cookie request, or a cookie that isn't valid (anymore); send a new one.
+                        fastopen = 1;
+                    }
+                }
+#endif
                 if (numsynlist == SGIP_TCP_MAXSYNS)
                 {
                     numsynlist--;
@@ -547,9 +879,6 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                     unsigned long myseq, myport;
                     myport = tcp->destport;
                     myseq  = sgIP_TCP_support_seqhash(srcip, destip, tcp->srcport, myport);
-                    // send relevant synack
-                    sgIP_TCP_SendSynReply(SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK, myseq, tcpseq + 1,
-                                          destip, srcip, myport, tcp->srcport, -1);
                     synlist[numsynlist].localseq    = myseq;
                     synlist[numsynlist].timebackoff = SGIP_TCP_SYNRETRYMS;
                     synlist[numsynlist].timenext    = SGIP_TCP_SYNRETRYMS;
@@ -559,6 +888,9 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                     synlist[numsynlist].localip     = destip;
                     synlist[numsynlist].localport   = myport;
                     synlist[numsynlist].remoteport  = tcp->srcport;
+                    synlist[numsynlist].fastopen    = fastopen;
+                    // send relevant synack
+                    sgIP_TCP_SendSynAck(&synlist[numsynlist]);
                     numsynlist++;
                 }
             }
@@ -568,9 +900,30 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
             switch (tcp->tcpflags & (SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK))
             {
                 case SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK: // both flags set
-                    // FIXME: shall check ack againts our seq instead.
-                    rec->ack      = tcpseq + 1;
-                    rec->sequence = tcpack;
+                    // check the ack covers our SYN, and no more than the data sent along with it.
+                    delta1 = (int)(tcpack - rec->sequence - 1);
+                    delta2 = rec->buf_tx_out - rec->buf_tx_in;
+                    if (delta2 < 0)
+                        delta2 += SGIP_TCP_TRANSMITBUFFERLENGTH;
+                    if (delta1 < 0 || delta1 > delta2)
+                        break;
+#ifdef SGIP_TCP_FASTOPEN
+                    {
+                        unsigned char *opt =
+                            sgIP_TCP_support_findoption(mb, SGIP_TCP_OPTION_FASTOPEN);
+                        if (opt)
+                            sgIP_TCP_FastOpenStore(rec->destip, opt + 2, opt[1] - 2);
+                    }
+#endif
+                    // drop whatever data the server took from the SYN, the rest is sent normally.
+                    delta1 += rec->buf_tx_in;
+                    if (delta1 >= SGIP_TCP_TRANSMITBUFFERLENGTH)
+                        delta1 -= SGIP_TCP_TRANSMITBUFFERLENGTH;
+                    rec->buf_tx_in     = delta1;
+                    rec->ack           = tcpseq + 1;
+                    rec->sequence      = tcpack;
+                    rec->sequence_next = tcpack;
+                    rec->txwindow      = rec->sequence + htons(tcp->window);
                     sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0);
                     rec->tcpstate   = SGIP_TCP_STATE_ESTABLISHED;
                     rec->retrycount = 0;
@@ -724,27 +1077,49 @@ int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
                     break;
             }
             break;
+    }
+    sgIP_memblock_free(mb);
+    sgIP_sockets_Notify(rec->socket);
 
-        case SGIP_TCP_STATE_TIME_WAIT: // wait to ensure remote tcp knows it's been terminated.
-            if (tcp->tcpflags & SGIP_TCP_FLAG_FIN)
-            {
-                // check sequence against receive window
-                delta1 = (int)(tcpseq - rec->ack);
-                delta2 = (int)(rec->rxwindow - tcpseq);
-                if (delta1 < 1 || delta2 < 0)
-                    break; // out of range, they should know better.
+    // Don't hold on to the whole record for 2MSL. This may free rec.
+    if (rec->tcpstate == SGIP_TCP_STATE_TIME_WAIT)
+        sgIP_TCP_EnterTimeWait(rec);
+    return 0;
+}
 
-                sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_ACK, 0); // send 'em a grat ACK
-            }
+// Called when an ICMP error comes back for a segment we sent. Errors that only mean the path
+// might be broken for a while are ignored once the connection is up (RFC 1122 4.2.3.9), but a
+// connection attempt fails right away instead of waiting for its retries to run out.
+void sgIP_TCP_ICMPError(unsigned long srcip, unsigned short srcport, unsigned long destip,
+                        unsigned short destport, unsigned long seq, int error)
+{
+    SGIP_INTR_PROTECT();
+    sgIP_Record_TCP *rec = tcprecords;
+    while (rec)
+    {
+        if (rec->srcport == srcport && rec->destport == destport && rec->destip == destip
+            && (rec->srcip == srcip || rec->srcip == 0) && rec->tcpstate != SGIP_TCP_STATE_CLOSED
+            && rec->tcpstate != SGIP_TCP_STATE_LISTEN)
             break;
+        rec = rec->next;
     }
-    sgIP_memblock_free(mb);
-    return 0;
+    // the segment must be one we sent and haven't had acked yet, or it's likely forged.
+    if (rec && (int)(seq - rec->sequence) >= 0 && (int)(rec->sequence_next - seq) >= 0)
+    {
+        if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT || error == ECONNREFUSED)
+        {
+            rec->errorcode = error;
+            rec->tcpstate  = SGIP_TCP_STATE_CLOSED;
+            sgIP_sockets_Notify(rec->socket);
+        }
+    }
+    SGIP_INTR_UNPROTECT();
 }
 
-sgIP_memblock *sgIP_TCP_GenHeader(sgIP_Record_TCP *rec, int flags, int datalength)
+sgIP_memblock *sgIP_TCP_GenHeader(sgIP_Record_TCP *rec, int flags, int datalength, int optlen)
 {
-    sgIP_memblock *mb = sgIP_memblock_alloc(datalength + 20 + sgIP_IP_RequiredHeaderSize());
+    sgIP_memblock *mb =
+        sgIP_memblock_alloc(datalength + 20 + optlen + sgIP_IP_RequiredHeaderSize());
     if (!mb)
         return 0;
 
@@ -757,7 +1132,7 @@ sgIP_memblock *sgIP_TCP_GenHeader(sgIP_Record_TCP *rec, int flags, int datalengt
     tcp->tcpflags        = flags;
     tcp->urg_ptr         = 0; // no support for URG data atm.
     tcp->checksum        = 0;
-    tcp->dataofs_        = 5 << 4; // header length == 20 (5*32bit)
+    tcp->dataofs_        = (5 + optlen / 4) << 4; // header length == 20 (5*32bit) + options
 
     int windowlen = rec->buf_rx_out - rec->buf_rx_in;
     if (windowlen < 0)
@@ -787,6 +1162,8 @@ void sgIP_TCP_FixChecksum(unsigned long srcip, unsigned long destip, sgIP_memblo
     sgIP_Header_TCP *tcp;
     tcp           = (sgIP_Header_TCP *)mb->datastart;
     tcp->checksum = 0;
+    if (sgIP_Hub_RouteOffload(destip, srcip) & SGIP_HWOFFLOAD_TXCHECKSUM)
+        return; // the interface doesn't need it, and a zero checksum isn't checked.
 
     int checksum = sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
     // add in checksum of "faux header"
@@ -809,6 +1186,8 @@ int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
 {
     // data sent is taken directly from the TX fifo.
     int i, j, k;
+    unsigned char opt[SGIP_TCP_FASTOPEN_MAXCOOKIELEN + 4];
+    int optlen = 0;
     if (!rec)
         return 0;
 
@@ -819,16 +1198,39 @@ int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
         j += SGIP_TCP_TRANSMITBUFFERLENGTH;
     if (datalength > j)
         datalength = j;
-    sgIP_memblock *mb = sgIP_TCP_GenHeader(rec, flags, datalength);
+#ifdef SGIP_TCP_FASTOPEN
+    if ((flags & (SGIP_TCP_FLAG_SYN | SGIP_TCP_FLAG_ACK)) == SGIP_TCP_FLAG_SYN)
+        optlen = sgIP_TCP_FastOpenSynOption(rec->destip, opt, datalength);
+#endif
+    if ((flags & SGIP_TCP_FLAG_SYN) && optlen <= 4)
+        datalength = 0; // only data with a TFO cookie may ride on the SYN
+    sgIP_memblock *mb = sgIP_TCP_GenHeader(rec, flags, datalength, optlen);
     if (!mb)
     {
         SGIP_INTR_UNPROTECT();
         return 0;
     }
+    for (i = 0; i < optlen; i++)
+        mb->datastart[20 + i] = opt[i];
+
+    // statistics, and time one segment at a time for the RTT estimate (never a retransmission).
+    rec->stats.segs_out++;
+    rec->stats.bytes_sent += datalength;
+    if (datalength > 0 && (int)(rec->sequence_next - rec->sequence) > 0)
+    {
+        rec->stats.total_retrans++;
+        rec->stats.rtt_timing = 0;
+    }
+    else if (datalength > 0 && !rec->stats.rtt_timing)
+    {
+        rec->stats.rtt_timing = 1;
+        rec->stats.rtt_seq    = rec->sequence + datalength;
+        rec->stats.rtt_start  = sgIP_timems;
+    }
 
     rec->sequence_next = rec->sequence + datalength;
 
-    j = 20; // destination offset in memblock for data
+    j = 20 + optlen; // destination offset in memblock for data
     k = rec->buf_tx_in;
     while (datalength > 0)
     {
@@ -854,10 +1256,19 @@ int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags, int datalength)
 
 int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsigned long srcip,
                           unsigned long destip, int srcport, int destport, int windowlen)
+{
+    return sgIP_TCP_SendSynReplyOpt(flags, seq, ack, srcip, destip, srcport, destport, windowlen,
+                                    0, 0);
+}
+
+// Same as sgIP_TCP_SendSynReply(), with optlen bytes of TCP options (a multiple of 4).
+int sgIP_TCP_SendSynReplyOpt(int flags, unsigned long seq, unsigned long ack, unsigned long srcip,
+                             unsigned long destip, int srcport, int destport, int windowlen,
+                             const unsigned char *options, int optlen)
 {
     SGIP_INTR_PROTECT();
 
-    sgIP_memblock *mb = sgIP_memblock_alloc(20 + sgIP_IP_RequiredHeaderSize());
+    sgIP_memblock *mb = sgIP_memblock_alloc(20 + optlen + sgIP_IP_RequiredHeaderSize());
     if (!mb)
     {
         SGIP_INTR_UNPROTECT();
@@ -873,7 +1284,9 @@ int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsig
     tcp->tcpflags        = flags;
     tcp->urg_ptr         = 0; // no support for URG data atm.
     tcp->checksum        = 0;
-    tcp->dataofs_        = 5 << 4; // header length == 20 (5*32bit)
+    tcp->dataofs_        = (5 + optlen / 4) << 4; // header length == 20 (5*32bit) + options
+    for (int i = 0; i < optlen; i++)
+        mb->datastart[20 + i] = options[i];
 
     if (windowlen < 0 || windowlen > 1400)
         windowlen = 1400; // don't want to deal with IP fragmentation.
@@ -886,6 +1299,48 @@ int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsig
     return 0;
 }
 
+// Moves a connection that has just entered TIME_WAIT to the TIME_WAIT table. The record is marked
+// as closed, and it is freed right away if the socket that owned it has already been closed.
+void sgIP_TCP_EnterTimeWait(sgIP_Record_TCP *rec)
+{
+    int i, j;
+    if (!rec)
+        return;
+
+    SGIP_INTR_PROTECT();
+    if (numtimewait == SGIP_TCP_MAXTIMEWAIT)
+    {
+        // no space left, reuse the entry that is closest to expiring.
+        j = 0;
+        for (i = 1; i < numtimewait; i++)
+        {
+            if ((int)(timewaitlist[i].expiry - timewaitlist[j].expiry) < 0)
+                j = i;
+        }
+        if (timewaitlist[j].port_reserved)
+            sgIP_portalloc_Release(&tcpports, ntohs(timewaitlist[j].localport));
+    }
+    else
+    {
+        j = numtimewait++;
+    }
+    timewaitlist[j].localip    = rec->srcip;
+    timewaitlist[j].remoteip   = rec->destip;
+    timewaitlist[j].localport  = rec->srcport;
+    timewaitlist[j].remoteport = rec->destport;
+    timewaitlist[j].localseq   = rec->sequence;
+    timewaitlist[j].remoteseq  = rec->ack;
+    timewaitlist[j].expiry     = sgIP_timems + SGIP_TCP_TIMEMS_2MSL;
+
+    // the port stays in use until the entry expires.
+    timewaitlist[j].port_reserved = rec->port_reserved;
+    rec->port_reserved            = 0;
+
+    rec->tcpstate = SGIP_TCP_STATE_CLOSED;
+    sgIP_sockets_ReleaseTCPRecord(rec);
+    SGIP_INTR_UNPROTECT();
+}
+
 sgIP_Record_TCP *sgIP_TCP_AllocRecord(void)
 {
     SGIP_INTR_PROTECT();
@@ -909,6 +1364,10 @@ sgIP_Record_TCP *sgIP_TCP_AllocRecord(void)
         rec->listendata    = 0;
         rec->want_shutdown = 0;
         rec->want_reack    = 0;
+        rec->port_reserved = 0;
+        rec->fastopen      = 0;
+        rec->socket        = 0;
+        memset(&rec->stats, 0, sizeof(rec->stats));
     }
     SGIP_INTR_UNPROTECT();
     return rec;
@@ -922,6 +1381,8 @@ void sgIP_TCP_FreeRecord(sgIP_Record_TCP *rec)
     sgIP_Record_TCP *t;
     int i, j;
     rec->tcpstate = 0;
+    if (rec->port_reserved)
+        sgIP_portalloc_Release(&tcpports, ntohs(rec->srcport));
     if (tcprecords == rec)
     {
         tcprecords = rec->next;
@@ -975,9 +1436,10 @@ int sgIP_TCP_Bind(sgIP_Record_TCP *rec, int srcport, unsigned long srcip)
     SGIP_INTR_PROTECT();
     if (rec->tcpstate == SGIP_TCP_STATE_NODATA)
     {
-        rec->srcip    = srcip;
-        rec->srcport  = srcport;
-        rec->tcpstate = SGIP_TCP_STATE_UNUSED;
+        rec->srcip         = srcip;
+        rec->srcport       = srcport;
+        rec->tcpstate      = SGIP_TCP_STATE_UNUSED;
+        rec->port_reserved = sgIP_portalloc_Reserve(&tcpports, ntohs(srcport));
     }
     SGIP_INTR_UNPROTECT();
     return 0;
@@ -1072,13 +1534,21 @@ int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
     if (!rec)
         return SGIP_ERROR(EINVAL);
     SGIP_INTR_PROTECT();
-    if (rec->tcpstate == SGIP_TCP_STATE_NODATA)
+    if (rec->tcpstate == SGIP_TCP_STATE_NODATA
+        || (rec->tcpstate == SGIP_TCP_STATE_UNUSED && rec->srcport == 0))
     {
         // need to bind a local address
-        rec->srcip    = sgIP_IP_GetLocalBindAddr(0, destip);
-        rec->srcport  = htons(sgIP_TCP_GetUnusedOutgoingPort());
-        rec->destip   = destip;
-        rec->destport = destport;
+        int port = sgIP_TCP_GetUnusedOutgoingPort();
+        if (port == 0)
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EADDRNOTAVAIL);
+        }
+        rec->srcip         = sgIP_IP_GetLocalBindAddr(rec->srcip, destip);
+        rec->srcport       = htons(port);
+        rec->port_reserved = 1;
+        rec->destip        = destip;
+        rec->destport      = destport;
     }
     else if (rec->tcpstate == SGIP_TCP_STATE_UNUSED)
     {
@@ -1089,13 +1559,26 @@ int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
     }
     else
     {
+        // a non-blocking connect() that's being retried, or a socket that's already in use.
+        int err = EINVAL;
+        if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT
+            || rec->tcpstate == SGIP_TCP_STATE_SYN_RECEIVED)
+            err = EALREADY;
+        else if (rec->tcpstate >= SGIP_TCP_STATE_ESTABLISHED
+                 && rec->tcpstate != SGIP_TCP_STATE_CLOSED)
+            err = EISCONN;
         SGIP_INTR_UNPROTECT();
-        return SGIP_ERROR(EINVAL);
+        return SGIP_ERROR(err);
     }
 
-    // send a SYN packet, and advance the state of the connection
-    rec->sequence = sgIP_TCP_support_seqhash(rec->srcip, rec->destip, rec->srcport, rec->destport);
-    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_SYN, 0);
+    // send a SYN packet, and advance the state of the connection. Anything already in the transmit
+    // buffer (from sgIP_TCP_FastOpenConnect) goes along with it if we have a TFO cookie.
+    rec->sequence      = sgIP_TCP_support_seqhash(rec->srcip, rec->destip, rec->srcport,
+                                                  rec->destport);
+    rec->sequence_next = rec->sequence;
+    sgIP_TCP_SendPacket(rec, SGIP_TCP_FLAG_SYN,
+                        sgIP_IP_MaxContentsSize(rec->destip) - 20
+                            - (SGIP_TCP_FASTOPEN_MAXCOOKIELEN + 4));
     rec->retrycount = 0;
     rec->tcpstate   = SGIP_TCP_STATE_SYN_SENT;
 
@@ -1103,15 +1586,121 @@ int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport)
     return 0;
 }
 
+// Queues data and connects, the data is sent on the SYN if we have a TFO cookie for the server.
+// Returns the amount of data queued.
+int sgIP_TCP_FastOpenConnect(sgIP_Record_TCP *rec, const char *datatosend, int datalength,
+                             unsigned long destip, int destport)
+{
+    if (!rec || !datatosend)
+        return SGIP_ERROR(EINVAL);
+    if (rec->tcpstate != SGIP_TCP_STATE_NODATA && rec->tcpstate != SGIP_TCP_STATE_UNUSED)
+        return SGIP_ERROR(EISCONN);
+
+    SGIP_INTR_PROTECT();
+    int retval = sgIP_TCP_Send(rec, datatosend, datalength, 0);
+    if (retval >= 0 && sgIP_TCP_Connect(rec, destip, destport) != 0)
+    {
+        rec->buf_tx_out = rec->buf_tx_in; // throw the data away again
+        retval          = -1;
+    }
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
+// Allows (or stops) a listening connection to accept data on the SYN from TFO clients.
+int sgIP_TCP_SetFastOpen(sgIP_Record_TCP *rec, int enable)
+{
+    if (!rec)
+        return SGIP_ERROR(EINVAL);
+#ifdef SGIP_TCP_FASTOPEN
+    SGIP_INTR_PROTECT();
+    if (enable && !rec->fastopen)
+    {
+        // mix fresh random bits into the key every time TFO is turned on, so it can't be guessed
+        // and cookies can't be forged. Clients with older cookies do a regular handshake.
+        for (int i = 0; i < 4; i++)
+            tfosecret[i] ^= sgIP_Random();
+    }
+    rec->fastopen = enable != 0;
+    SGIP_INTR_UNPROTECT();
+    return 0;
+#else
+    (void)enable;
+    return SGIP_ERROR(ENOPROTOOPT);
+#endif
+}
+
+// Fills in a struct tcp_info, copying at most *infolen bytes of it to info.
+int sgIP_TCP_GetInfo(sgIP_Record_TCP *rec, void *info, int *infolen)
+{
+    if (!rec || !info || !infolen || *infolen < 0)
+        return SGIP_ERROR(EINVAL);
+
+    struct tcp_info ti;
+    int i;
+    SGIP_INTR_PROTECT();
+    ti.tcpi_state       = rec->tcpstate;
+    ti.tcpi_retransmits = rec->retrycount;
+    ti.tcpi_pad         = 0;
+    ti.tcpi_rto         = rec->time_backoff;
+    ti.tcpi_rtt         = rec->stats.srtt;
+    ti.tcpi_rttvar      = rec->stats.rttvar;
+
+    i               = (int)(rec->txwindow - rec->sequence);
+    ti.tcpi_snd_wnd = i < 0 ? 0 : i;
+    i               = (int)(rec->rxwindow - rec->ack);
+    ti.tcpi_rcv_wnd = i < 0 ? 0 : i;
+    i               = rec->buf_tx_out - rec->buf_tx_in;
+    if (i < 0)
+        i += SGIP_TCP_TRANSMITBUFFERLENGTH;
+    ti.tcpi_snd_buf = i;
+    i               = rec->buf_rx_out - rec->buf_rx_in;
+    if (i < 0)
+        i += SGIP_TCP_RECEIVEBUFFERLENGTH;
+    ti.tcpi_rcv_buf = i;
+
+    ti.tcpi_segs_out       = rec->stats.segs_out;
+    ti.tcpi_segs_in        = rec->stats.segs_in;
+    ti.tcpi_total_retrans  = rec->stats.total_retrans;
+    ti.tcpi_dup_acks       = rec->stats.dup_acks;
+    ti.tcpi_ooo_segs       = rec->stats.ooo_segs;
+    ti.tcpi_bytes_sent     = rec->stats.bytes_sent;
+    ti.tcpi_bytes_acked    = rec->stats.bytes_acked;
+    ti.tcpi_bytes_received = rec->stats.bytes_received;
+    SGIP_INTR_UNPROTECT();
+
+    if (*infolen > (int)sizeof(ti))
+        *infolen = sizeof(ti);
+    memcpy(info, &ti, *infolen);
+    return 0;
+}
+
 int sgIP_TCP_Send(sgIP_Record_TCP *rec, const char *datatosend, int datalength, int flags)
+{
+    if (!datatosend)
+        return SGIP_ERROR(EINVAL);
+
+    struct iovec iov;
+    iov.iov_base = (void *)datatosend;
+    iov.iov_len  = datalength;
+    return sgIP_TCP_SendV(rec, &iov, 1, flags);
+}
+
+// Queues as much of the buffers as fits in the transmit buffer, in order, before deciding whether
+// to transmit. Data gathered from several buffers goes out together rather than one segment each.
+int sgIP_TCP_SendV(sgIP_Record_TCP *rec, const struct iovec *iov, int iovcnt, int flags)
 {
     (void)flags;
 
-    if (!rec || !datatosend)
+    if (!rec || (!iov && iovcnt))
         return SGIP_ERROR(EINVAL);
     if (rec->want_shutdown)
         return SGIP_ERROR(ESHUTDOWN);
 
+    int datalength = 0;
+    for (int v = 0; v < iovcnt; v++)
+        datalength += iov[v].iov_len;
+
     SGIP_INTR_PROTECT();
     int bufsize;
     bufsize = rec->buf_tx_out - rec->buf_tx_in;
@@ -1127,13 +1716,16 @@ int sgIP_TCP_Send(sgIP_Record_TCP *rec, const char *datatosend, int datalength,
     bufsize = SGIP_TCP_TRANSMITBUFFERLENGTH - bufsize - 1; // space left in buffer
     if (datalength > bufsize)
         datalength = bufsize;
-    int i, j;
+    int i, j, k;
     j = rec->buf_tx_out;
-    for (i = 0; i < datalength; i++)
+    k = datalength;
+    for (int v = 0; v < iovcnt && k > 0; v++)
     {
-        rec->buf_tx[j++] = datatosend[i];
-        if (j == SGIP_TCP_TRANSMITBUFFERLENGTH)
-            j = 0;
+        i = iov[v].iov_len;
+        if (i > k)
+            i = k;
+        j = sgIP_CopyToRing(rec->buf_tx, SGIP_TCP_TRANSMITBUFFERLENGTH, j, iov[v].iov_base, i);
+        k -= i;
     }
     rec->buf_tx_out = j;
     // check for immediate transmit
@@ -1190,13 +1782,8 @@ int sgIP_TCP_Recv(sgIP_Record_TCP *rec, char *databuf, int buflength, int flags)
     if (buflength > rxlen)
         buflength = rxlen;
     int i, j;
-    j = rec->buf_rx_in;
-    for (i = 0; i < buflength; i++)
-    {
-        databuf[i] = rec->buf_rx[j++];
-        if (j == SGIP_TCP_RECEIVEBUFFERLENGTH)
-            j = 0;
-    }
+    j = sgIP_CopyFromRing(rec->buf_rx, SGIP_TCP_RECEIVEBUFFERLENGTH, rec->buf_rx_in, databuf,
+                          buflength);
 
     if (!(flags & MSG_PEEK))
     {
@@ -11,6 +11,8 @@
 extern "C" {
 #endif
 
+#include <sys/uio.h>
+
 #include "arm9/sgIP/sgIP_Config.h"
 #include "arm9/sgIP/sgIP_memblock.h"
 
@@ -38,6 +40,13 @@ enum SGIP_TCP_STATE
 #define SGIP_TCP_FLAG_ACK 16
 #define SGIP_TCP_FLAG_URG 32
 
+#define SGIP_TCP_OPTION_END      0
+#define SGIP_TCP_OPTION_NOP      1
+#define SGIP_TCP_OPTION_FASTOPEN 34
+
+#define SGIP_TCP_FASTOPEN_COOKIELEN    8  // length of the cookies we hand out
+#define SGIP_TCP_FASTOPEN_MAXCOOKIELEN 16 // longest cookie a server may give us
+
 typedef struct SGIP_HEADER_TCP
 {
     unsigned short srcport, destport;
@@ -51,6 +60,20 @@ typedef struct SGIP_HEADER_TCP
     unsigned char options[4];
 } sgIP_Header_TCP;
 
+// sgIP_TCP_Stats - per-connection counters, reported by getsockopt(TCP_INFO).
+typedef struct SGIP_TCP_STATS
+{
+    unsigned long segs_out, segs_in;
+    unsigned long total_retrans;
+    unsigned long dup_acks;
+    unsigned long ooo_segs;
+    unsigned long bytes_sent, bytes_acked, bytes_received;
+    int srtt, rttvar;        // smoothed round trip time and variation (ms), srtt 0 until sampled
+    int rtt_timing;          // 1 while a segment is being timed
+    unsigned long rtt_seq;   // sequence number whose ack ends the measurement
+    unsigned long rtt_start; // sgIP_timems when the timed segment was sent
+} sgIP_TCP_Stats;
+
 // sgIP_Record_TCP - a TCP record, to store data for an active TCP connection.
 typedef struct SGIP_RECORD_TCP
 {
@@ -74,6 +97,10 @@ typedef struct SGIP_RECORD_TCP
     int errorcode;
     int want_shutdown; // 0= don't want shutdown, 1= want shutdown, 2= being shutdown
     int want_reack;
+    int port_reserved; // srcport is held in the ephemeral port allocator by this record
+    int fastopen;      // listening: accept data on the SYN from clients with a valid TFO cookie
+    int socket;        // socket that owns the record (1-based, 0 if none), told about events
+    sgIP_TCP_Stats stats;
 
     // TCP buffer information:
     int buf_rx_in, buf_rx_out;
@@ -91,16 +118,44 @@ typedef struct SGIP_TCP_SYNCOOKIE
     unsigned short localport, remoteport;
     unsigned long timenext, timebackoff;
     sgIP_Record_TCP *linked; // parent listening connection
+    int fastopen;            // send a TFO cookie along with the SYN-ACK
 } sgIP_TCP_SYNCookie;
 
+// sgIP_TCP_TimeWait - what's left of a connection in TIME_WAIT, enough to answer late FINs.
+typedef struct SGIP_TCP_TIMEWAIT
+{
+    unsigned long localip, remoteip;
+    unsigned short localport, remoteport;
+    unsigned long localseq;  // our sequence number after the FIN
+    unsigned long remoteseq; // next remote sequence number expected (after their FIN)
+    unsigned long expiry;    // sgIP_timems value at which the entry is released
+    int port_reserved;       // localport is held in the ephemeral port allocator by this entry
+} sgIP_TCP_TimeWait;
+
+// sgIP_TCP_FastOpenCookie - a TFO cookie we've been given by a server.
+typedef struct SGIP_TCP_FASTOPENCOOKIE
+{
+    unsigned long remoteip;
+    unsigned long lastused; // sgIP_timems of the last time the cookie was stored or used
+    int len;                // 0 if the entry is unused
+    unsigned char cookie[SGIP_TCP_FASTOPEN_MAXCOOKIELEN];
+} sgIP_TCP_FastOpenCookie;
+
 void sgIP_TCP_Init(void);
 void sgIP_TCP_Timer(void);
 
 int sgIP_TCP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip);
+void sgIP_TCP_ICMPError(unsigned long srcip, unsigned short srcport, unsigned long destip,
+                        unsigned short destport, unsigned long seq, int error);
 int sgIP_TCP_SendPacket(sgIP_Record_TCP *rec, int flags,
                         int datalength); // data sent is taken directly from the TX fifo.
 int sgIP_TCP_SendSynReply(int flags, unsigned long seq, unsigned long ack, unsigned long srcip,
                           unsigned long destip, int srcport, int destport, int windowlen);
+int sgIP_TCP_SendSynReplyOpt(int flags, unsigned long seq, unsigned long ack, unsigned long srcip,
+                             unsigned long destip, int srcport, int destport, int windowlen,
+                             const unsigned char *options, int optlen);
+void sgIP_TCP_SendSynAck(sgIP_TCP_SYNCookie *syn);
+void sgIP_TCP_EnterTimeWait(sgIP_Record_TCP *rec);
 
 sgIP_Record_TCP *sgIP_TCP_AllocRecord(void);
 void sgIP_TCP_FreeRecord(sgIP_Record_TCP *rec);
@@ -109,7 +164,12 @@ int sgIP_TCP_Listen(sgIP_Record_TCP *rec, int maxlisten);
 sgIP_Record_TCP *sgIP_TCP_Accept(sgIP_Record_TCP *rec);
 int sgIP_TCP_Close(sgIP_Record_TCP *rec);
 int sgIP_TCP_Connect(sgIP_Record_TCP *rec, unsigned long destip, int destport);
+int sgIP_TCP_FastOpenConnect(sgIP_Record_TCP *rec, const char *datatosend, int datalength,
+                             unsigned long destip, int destport);
+int sgIP_TCP_SetFastOpen(sgIP_Record_TCP *rec, int enable);
+int sgIP_TCP_GetInfo(sgIP_Record_TCP *rec, void *info, int *infolen);
 int sgIP_TCP_Send(sgIP_Record_TCP *rec, const char *datatosend, int datalength, int flags);
+int sgIP_TCP_SendV(sgIP_Record_TCP *rec, const struct iovec *iov, int iovcnt, int flags);
 int sgIP_TCP_Recv(sgIP_Record_TCP *rec, char *databuf, int buflength, int flags);
 
 #ifdef __cplusplus
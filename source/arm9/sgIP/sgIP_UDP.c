@@ -4,66 +4,47 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <string.h>
+
+#include "arm9/sgIP/sgIP_ARP.h"
 #include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_IP.h"
 #include "arm9/sgIP/sgIP_UDP.h"
+#include "arm9/sgIP/sgIP_portalloc.h"
+#include "arm9/sgIP/sgIP_sockets.h"
 
 sgIP_Record_UDP *udprecords;
-int udpport_counter;
+sgIP_PortAlloc udpports;
+unsigned int udpports_bitmap[SGIP_PORTALLOC_WORDS(SGIP_UDP_FIRSTOUTGOINGPORT,
+                                                  SGIP_UDP_LASTOUTGOINGPORT)];
 extern volatile unsigned long sgIP_timems;
 
 void sgIP_UDP_Init(void)
 {
-    udprecords      = 0;
-    udpport_counter = SGIP_UDP_FIRSTOUTGOINGPORT;
+    udprecords = 0;
+    sgIP_portalloc_Init(&udpports, udpports_bitmap, SGIP_UDP_FIRSTOUTGOINGPORT,
+                        SGIP_UDP_LASTOUTGOINGPORT);
 }
 
+// Returns a free port in host byte order, or 0 if they are all in use.
 int sgIP_UDP_GetUnusedOutgoingPort(void)
 {
-    int myport, clear;
-    sgIP_Record_UDP *rec;
-    udpport_counter += sgIP_timems & 1023; // semi-random
-
-    if (udpport_counter > SGIP_UDP_LASTOUTGOINGPORT)
-        udpport_counter = SGIP_UDP_FIRSTOUTGOINGPORT;
-
-    while (1)
-    {
-        rec    = udprecords;
-        myport = udpport_counter++;
-        if (udpport_counter > SGIP_UDP_LASTOUTGOINGPORT)
-            udpport_counter = SGIP_UDP_FIRSTOUTGOINGPORT;
-        clear = 1;
-        while (rec)
-        {
-            if (rec->srcport == myport)
-            {
-                clear = 0;
-                break;
-            }
-            rec = rec->next;
-        }
-        if (clear)
-            return myport;
-    }
+    return sgIP_portalloc_Get(&udpports);
 }
 
-int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
-                          int totallength)
+// Sum of the "faux header" fields that don't depend on the packet.
+static unsigned long sgIP_UDP_PseudoSum(unsigned long srcip, unsigned long destip)
 {
-    if (!mb)
-        return 0;
-    if (mb->totallength & 1)
-        mb->datastart[mb->totallength] = 0;
+    return (destip & 0xFFFF) + (destip >> 16) + (srcip & 0xFFFF) + (srcip >> 16) + ((17) << 8);
+}
 
+static int sgIP_UDP_ChecksumWithPseudoSum(sgIP_memblock *mb, unsigned long pseudosum,
+                                          int totallength)
+{
     int checksum = sgIP_memblock_IPChecksum(mb, 0, mb->totallength);
     // add in checksum of "faux header"
-    checksum += (destip & 0xFFFF);
-    checksum += (destip >> 16);
-    checksum += (srcip & 0xFFFF);
-    checksum += (srcip >> 16);
+    checksum += pseudosum;
     checksum += htons(totallength);
-    checksum += (17) << 8;
     checksum = (checksum & 0xFFFF) + (checksum >> 16);
     checksum = (checksum & 0xFFFF) + (checksum >> 16);
 
@@ -73,15 +54,81 @@ int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long
     return checksum;
 }
 
+int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
+                          int totallength)
+{
+    if (!mb)
+        return 0;
+
+    return sgIP_UDP_ChecksumWithPseudoSum(mb, sgIP_UDP_PseudoSum(srcip, destip), totallength);
+}
+
+// Gives an unbound record an ephemeral port.
+static int sgIP_UDP_AutoBind(sgIP_Record_UDP *rec)
+{
+    if (rec->state == SGIP_UDP_STATE_BOUND)
+        return 0;
+
+    int port = sgIP_UDP_GetUnusedOutgoingPort();
+    if (port == 0)
+        return SGIP_ERROR(EADDRNOTAVAIL);
+    rec->srcip         = 0;
+    rec->srcport       = htons(port);
+    rec->port_reserved = 1;
+    rec->state         = SGIP_UDP_STATE_BOUND;
+    return 0;
+}
+
+// Makes sure the cached route of a connected record is up to date. Returns 0 if it can't be used,
+// for example because the hardware address of the next hop hasn't been resolved yet.
+static int sgIP_UDP_UpdateRoute(sgIP_Record_UDP *rec)
+{
+    if (rec->route.valid && rec->route.generation == sgIP_ARP_generation)
+        return 1;
+
+    unsigned long nexthop;
+    unsigned long srcip      = sgIP_IP_GetLocalBindAddr(rec->srcip, rec->destip);
+    sgIP_Hub_HWInterface *hw = sgIP_Hub_Route(rec->destip, srcip, &nexthop);
+    rec->route.valid         = 0;
+    if (!hw || !sgIP_ARP_Lookup(hw, nexthop, rec->route.hwaddr, &rec->route.arpslot))
+        return 0;
+
+    rec->route.hw         = hw;
+    rec->route.srcip      = srcip;
+    rec->route.pseudosum  = sgIP_UDP_PseudoSum(srcip, rec->destip);
+    rec->route.generation = sgIP_ARP_generation;
+    rec->route.valid      = 1;
+    return 1;
+}
+
+// Unlinks the first datagram in the incoming queue and returns it (its memblocks, chained).
+static sgIP_memblock *sgIP_UDP_Dequeue(sgIP_Record_UDP *rec)
+{
+    sgIP_memblock *first = rec->incoming_queue;
+    sgIP_memblock *last  = first;
+    int totlen           = first->totallength - first->thislength;
+    while (totlen > 0 && last->next)
+    {
+        last = last->next;
+        totlen -= last->thislength;
+    }
+    rec->incoming_queue = last->next;
+    last->next          = 0;
+    if (!rec->incoming_queue)
+        rec->incoming_queue_end = 0;
+    rec->rcvqueued -= first->totallength;
+    return first;
+}
+
 int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip)
 {
     if (!mb)
         return 0;
 
-    int chk = sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength);
     sgIP_Header_UDP *udp;
     udp = (sgIP_Header_UDP *)mb->datastart;
-    if (chk != 0xFFFF && udp->checksum != 0)
+    if (udp->checksum != 0 && !(sgIP_Hub_ReceiveOffload() & SGIP_HWOFFLOAD_RXCHECKSUM)
+        && sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength) != 0xFFFF)
     {
         SGIP_DEBUG_MESSAGE(("UDP receive checksum incorrect"));
         sgIP_memblock_free(mb);
@@ -95,8 +142,9 @@ int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     while (rec)
     {
         if ((rec->srcip == destip || rec->srcip == 0) && rec->srcport == udp->destport
-            && rec->state != SGIP_UDP_STATE_UNUSED)
-            break; // a match!
+            && rec->state != SGIP_UDP_STATE_UNUSED
+            && (!rec->destport || (rec->destip == srcip && rec->destport == udp->srcport)))
+            break; // a match! (connected sockets only take datagrams from their peer)
         rec = rec->next;
     }
     if (!rec)
@@ -110,6 +158,26 @@ int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     // record queue.
     sgIP_memblock_exposeheader(mb, 4);
     *((unsigned long *)mb->datastart) = srcip; // keep srcip around.
+
+    // keep the queue under the receive buffer size, so a socket that isn't read can't hold on to
+    // all the memblocks. An empty queue always takes one datagram, so a reassembled datagram that
+    // is bigger than the buffer can still be received.
+    if (rec->droppolicy == SO_DROP_OLDEST && mb->totallength <= rec->rcvbuf)
+    {
+        while (rec->incoming_queue && rec->rcvqueued + mb->totallength > rec->rcvbuf)
+        {
+            sgIP_memblock_free(sgIP_UDP_Dequeue(rec));
+            rec->dropped++;
+        }
+    }
+    if (rec->incoming_queue && rec->rcvqueued + mb->totallength > rec->rcvbuf)
+    {
+        rec->dropped++;
+        sgIP_memblock_free(mb);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
+    rec->rcvqueued += mb->totallength;
     if (rec->incoming_queue == 0)
     {
         rec->incoming_queue = mb;
@@ -125,23 +193,62 @@ int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long
     rec->incoming_queue_end = tmb;
     // ok, data added to queue - yay!
     // that means... we're done.
+    sgIP_sockets_Notify(rec->socket);
 
     SGIP_INTR_UNPROTECT();
     return 0;
 }
 
+// Called when an ICMP error comes back for a datagram we sent. Like other stacks, only connected
+// sockets are told, unconnected ones can't tell which of their datagrams it was about.
+void sgIP_UDP_ICMPError(unsigned long srcip, unsigned short srcport, unsigned long destip,
+                        unsigned short destport, int error)
+{
+    SGIP_INTR_PROTECT();
+    sgIP_Record_UDP *rec = udprecords;
+    while (rec)
+    {
+        if (rec->srcport == srcport && rec->destport == destport && rec->destip == destip
+            && (rec->srcip == srcip || rec->srcip == 0) && rec->state != SGIP_UDP_STATE_UNUSED)
+        {
+            rec->errorcode = error;
+            sgIP_sockets_Notify(rec->socket);
+            break;
+        }
+        rec = rec->next;
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
 int sgIP_UDP_SendPacket(sgIP_Record_UDP *rec, const char *data, int datalen, unsigned long destip,
                         int destport)
 {
-    if (!rec || !data)
+    if (!data)
         return SGIP_ERROR(EINVAL);
 
-    if (rec->state != SGIP_UDP_STATE_BOUND)
-    {
-        rec->srcip   = 0;
-        rec->srcport = sgIP_UDP_GetUnusedOutgoingPort();
-        rec->state   = SGIP_UDP_STATE_BOUND;
-    }
+    struct iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len  = datalen;
+    return sgIP_UDP_SendPacketV(rec, &iov, 1, destip, destport);
+}
+
+// Gathers the buffers into a single datagram (and a single memblock).
+int sgIP_UDP_SendPacketV(sgIP_Record_UDP *rec, const struct iovec *iov, int iovcnt,
+                         unsigned long destip, int destport)
+{
+    if (!rec || (!iov && iovcnt))
+        return SGIP_ERROR(EINVAL);
+
+    int datalen = 0;
+    for (int v = 0; v < iovcnt; v++)
+        datalen += iov[v].iov_len;
+
+    // larger datagrams are fragmented, but the IP packet can't go over 64KB.
+    if (datalen > 0xFFFF - 8 - sgIP_IP_RequiredHeaderSize())
+        return SGIP_ERROR(EMSGSIZE);
+
+    if (sgIP_UDP_AutoBind(rec) < 0)
+        return -1;
 
     sgIP_memblock *mb = sgIP_memblock_alloc(sgIP_IP_RequiredHeaderSize() + 8 + datalen);
     if (!mb)
@@ -149,18 +256,46 @@ int sgIP_UDP_SendPacket(sgIP_Record_UDP *rec, const char *data, int datalen, uns
     sgIP_memblock_exposeheader(mb, -sgIP_IP_RequiredHeaderSize()); // hide IP header space for later
 
     SGIP_INTR_PROTECT();
-    unsigned long srcip  = sgIP_IP_GetLocalBindAddr(rec->srcip, destip);
+    // connected sockets talking to their peer take the cached route, unless the datagram has to
+    // be fragmented.
+    int fast = rec->destport && destip == rec->destip && destport == rec->destport
+               && mb->totallength <= sgIP_IP_MaxContentsSize(destip) && sgIP_UDP_UpdateRoute(rec);
+    unsigned long srcip  = fast ? rec->route.srcip : sgIP_IP_GetLocalBindAddr(rec->srcip, destip);
     sgIP_Header_UDP *udp = (sgIP_Header_UDP *)mb->datastart;
     udp->srcport         = rec->srcport;
     udp->destport        = destport;
     udp->length          = htons(datalen + 8);
     udp->checksum        = 0;
 
-    for (int i = 0; i < datalen; i++)
-        mb->datastart[i + 8] = data[i];
+    int ofs = 8;
+    for (int v = 0; v < iovcnt; v++)
+        ofs += sgIP_memblock_CopyFromLinear(mb, iov[v].iov_base, ofs, iov[v].iov_len);
 
-    udp->checksum = sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength);
-    sgIP_IP_SendViaIP(mb, 17, srcip, destip);
+    if (fast)
+    {
+        if (!(rec->route.hw->offload & SGIP_HWOFFLOAD_TXCHECKSUM))
+            udp->checksum =
+                sgIP_UDP_ChecksumWithPseudoSum(mb, rec->route.pseudosum, mb->totallength);
+        sgIP_IP_BuildHeader(mb, PROTOCOL_IP_UDP, srcip, destip);
+
+        sgIP_memblock_exposeheader(mb, 14);
+        sgIP_Header_Ethernet *ether = (sgIP_Header_Ethernet *)mb->datastart;
+        for (int i = 0; i < 6; i++)
+        {
+            ether->src_mac[i]  = rec->route.hw->hwaddr[i];
+            ether->dest_mac[i] = rec->route.hwaddr[i];
+        }
+        ether->protocol = PROTOCOL_ETHER_IP;
+        sgIP_ARP_Touch(rec->route.arpslot); // keep the neighbour from expiring while it's in use
+        sgIP_Hub_SendRawPacket(rec->route.hw, mb);
+    }
+    else
+    {
+        // a zero checksum means there's none, for interfaces that don't need it.
+        if (!(sgIP_Hub_RouteOffload(destip, srcip) & SGIP_HWOFFLOAD_TXCHECKSUM))
+            udp->checksum = sgIP_UDP_CalcChecksum(mb, srcip, destip, mb->totallength);
+        sgIP_IP_SendViaIP(mb, 17, srcip, destip);
+    }
 
     SGIP_INTR_UNPROTECT();
     return datalen;
@@ -177,8 +312,16 @@ sgIP_Record_UDP *sgIP_UDP_AllocRecord(void)
         rec->destport           = 0;
         rec->incoming_queue     = 0;
         rec->incoming_queue_end = 0;
+        rec->rcvbuf             = SGIP_UDP_RCVBUF_DEFAULT;
+        rec->rcvqueued          = 0;
+        rec->droppolicy         = SO_DROP_NEWEST;
+        rec->dropped            = 0;
+        rec->errorcode          = 0;
+        rec->route.valid        = 0;
         rec->srcip              = 0;
         rec->srcport            = 0;
+        rec->port_reserved      = 0;
+        rec->socket             = 0;
         rec->state              = 0;
         rec->next               = udprecords;
         udprecords              = rec;
@@ -200,6 +343,8 @@ void sgIP_UDP_FreeRecord(sgIP_Record_UDP *rec)
         sgIP_memblock_free(rec->incoming_queue); // woohoo!
 
     rec->state = 0;
+    if (rec->port_reserved)
+        sgIP_portalloc_Release(&udpports, ntohs(rec->srcport));
     if (udprecords == rec)
     {
         udprecords = rec->next;
@@ -230,8 +375,11 @@ int sgIP_UDP_Bind(sgIP_Record_UDP *rec, int srcport, unsigned long srcip)
     SGIP_INTR_PROTECT();
     if (rec->state != SGIP_UDP_STATE_UNUSED)
     {
-        rec->srcip   = srcip;
-        rec->srcport = srcport;
+        if (rec->port_reserved)
+            sgIP_portalloc_Release(&udpports, ntohs(rec->srcport));
+        rec->srcip         = srcip;
+        rec->srcport       = srcport;
+        rec->port_reserved = sgIP_portalloc_Reserve(&udpports, ntohs(srcport));
         if (rec->state == SGIP_UDP_STATE_UNBOUND)
             rec->state = SGIP_UDP_STATE_BOUND;
     }
@@ -239,19 +387,60 @@ int sgIP_UDP_Bind(sgIP_Record_UDP *rec, int srcport, unsigned long srcip)
     return 0;
 }
 
+// Sets the peer of the record (or clears it, with a 0 port). Sends to the peer use a cached route,
+// and only datagrams from the peer are received.
+int sgIP_UDP_Connect(sgIP_Record_UDP *rec, unsigned long destip, int destport)
+{
+    if (!rec)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    int retval = destport ? sgIP_UDP_AutoBind(rec) : 0;
+    if (retval == 0)
+    {
+        rec->destip      = destport ? destip : 0;
+        rec->destport    = destport;
+        rec->route.valid = 0;
+        rec->errorcode   = 0;
+    }
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
 int sgIP_UDP_RecvFrom(sgIP_Record_UDP *rec, char *destbuf, int buflength, int flags,
                       unsigned long *sender_ip, unsigned short *sender_port)
+{
+    if (!destbuf)
+        return SGIP_ERROR(EINVAL);
+
+    struct iovec iov;
+    iov.iov_base = destbuf;
+    iov.iov_len  = buflength;
+    return sgIP_UDP_RecvFromV(rec, &iov, 1, flags, sender_ip, sender_port);
+}
+
+// Scatters the next datagram over the buffers, which must be large enough to hold all of it.
+int sgIP_UDP_RecvFromV(sgIP_Record_UDP *rec, const struct iovec *iov, int iovcnt, int flags,
+                       unsigned long *sender_ip, unsigned short *sender_port)
 {
     (void)flags;
 
-    if (!rec || !destbuf || !sender_ip || !sender_port || buflength == 0)
+    if (!rec || !iov || !sender_ip || !sender_port)
+        return SGIP_ERROR(EINVAL);
+
+    int buflength = 0;
+    for (int v = 0; v < iovcnt; v++)
+        buflength += iov[v].iov_len;
+    if (buflength == 0)
         return SGIP_ERROR(EINVAL);
 
     SGIP_INTR_PROTECT();
     if (rec->incoming_queue == 0)
     {
+        int error      = rec->errorcode; // a pending ICMP error, if there's nothing to receive
+        rec->errorcode = 0;
         SGIP_INTR_UNPROTECT();
-        return SGIP_ERROR(EWOULDBLOCK);
+        return SGIP_ERROR(error ? error : EWOULDBLOCK);
     }
     int packetlen = rec->incoming_queue->totallength - 12;
     if (packetlen > buflength)
@@ -262,17 +451,30 @@ int sgIP_UDP_RecvFrom(sgIP_Record_UDP *rec, char *destbuf, int buflength, int fl
     sgIP_memblock *mb;
     *sender_ip   = *((unsigned long *)rec->incoming_queue->datastart);
     *sender_port = ((unsigned short *)rec->incoming_queue->datastart)[2];
-    int totlen, first, buf_start, i;
+    int totlen, first, buf_start, i, n;
+    int v = 0, vofs = 0; // position in the buffers
     totlen    = rec->incoming_queue->totallength;
     first     = 12;
     buf_start = 0;
+    rec->rcvqueued -= totlen;
 
     while (totlen > 0 && rec->incoming_queue)
     {
         totlen -= rec->incoming_queue->thislength;
 
-        for (i = first; i < rec->incoming_queue->thislength; i++)
-            destbuf[buf_start + i - first] = rec->incoming_queue->datastart[i];
+        for (i = first; i < rec->incoming_queue->thislength; i += n)
+        {
+            while (vofs == (int)iov[v].iov_len)
+            {
+                v++;
+                vofs = 0;
+            }
+            n = rec->incoming_queue->thislength - i;
+            if (n > (int)iov[v].iov_len - vofs)
+                n = iov[v].iov_len - vofs;
+            memcpy((char *)iov[v].iov_base + vofs, rec->incoming_queue->datastart + i, n);
+            vofs += n;
+        }
 
         buf_start += rec->incoming_queue->thislength - first;
         first               = 0;
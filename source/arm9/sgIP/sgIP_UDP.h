@@ -11,7 +11,10 @@
 extern "C" {
 #endif
 
+#include <sys/uio.h>
+
 #include "arm9/sgIP/sgIP_Config.h"
+#include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_memblock.h"
 
 enum SGIP_UDP_STATE
@@ -27,6 +30,19 @@ typedef struct SGIP_HEADER_UDP
     unsigned short length, checksum;
 } sgIP_Header_UDP;
 
+// sgIP_UDP_Route - everything needed to send to the peer of a connected socket without looking
+// up the route, source address or hardware address again.
+typedef struct SGIP_UDP_ROUTE
+{
+    int valid;
+    unsigned long generation; // sgIP_ARP_generation when it was filled in
+    sgIP_Hub_HWInterface *hw;
+    unsigned long srcip;
+    unsigned long pseudosum;                 // checksum of the pseudo header, except for the length
+    unsigned char hwaddr[SGIP_MAXHWADDRLEN]; // hardware address of the next hop
+    int arpslot;                             // its ARP record, -1 for broadcasts
+} sgIP_UDP_Route;
+
 typedef struct SGIP_RECORD_UDP
 {
     struct SGIP_RECORD_UDP *next;
@@ -34,10 +50,20 @@ typedef struct SGIP_RECORD_UDP
     int state;
     unsigned long srcip;
     unsigned long destip;
+    // destip/destport are the peer of a connected socket, destport is 0 if it isn't connected
     unsigned short srcport, destport;
+    int port_reserved; // srcport is held in the ephemeral port allocator by this record
+    int socket;        // socket that owns the record (1-based, 0 if none), told about events
 
     sgIP_memblock *incoming_queue;
     sgIP_memblock *incoming_queue_end;
+    int rcvbuf;            // most bytes allowed in incoming_queue (SO_RCVBUF)
+    int rcvqueued;         // bytes in incoming_queue
+    int droppolicy;        // SO_DROP_NEWEST or SO_DROP_OLDEST
+    unsigned long dropped; // datagrams dropped because the queue was full
+    int errorcode;         // error from an ICMP message, reported by the next receive
+
+    sgIP_UDP_Route route; // to destip, if connected
 
 } sgIP_Record_UDP;
 
@@ -46,15 +72,22 @@ void sgIP_UDP_Init(void);
 int sgIP_UDP_CalcChecksum(sgIP_memblock *mb, unsigned long srcip, unsigned long destip,
                           int totallength);
 int sgIP_UDP_ReceivePacket(sgIP_memblock *mb, unsigned long srcip, unsigned long destip);
+void sgIP_UDP_ICMPError(unsigned long srcip, unsigned short srcport, unsigned long destip,
+                        unsigned short destport, int error);
 int sgIP_UDP_SendPacket(sgIP_Record_UDP *rec, const char *data, int datalen, unsigned long destip,
                         int destport);
+int sgIP_UDP_SendPacketV(sgIP_Record_UDP *rec, const struct iovec *iov, int iovcnt,
+                         unsigned long destip, int destport);
 
 sgIP_Record_UDP *sgIP_UDP_AllocRecord(void);
 void sgIP_UDP_FreeRecord(sgIP_Record_UDP *rec);
 
 int sgIP_UDP_Bind(sgIP_Record_UDP *rec, int srcport, unsigned long srcip);
+int sgIP_UDP_Connect(sgIP_Record_UDP *rec, unsigned long destip, int destport);
 int sgIP_UDP_RecvFrom(sgIP_Record_UDP *rec, char *destbuf, int buflength, int flags,
                       unsigned long *sender_ip, unsigned short *sender_port);
+int sgIP_UDP_RecvFromV(sgIP_Record_UDP *rec, const struct iovec *iov, int iovcnt, int flags,
+                       unsigned long *sender_ip, unsigned short *sender_port);
 int sgIP_UDP_SendTo(sgIP_Record_UDP *rec, const char *buf, int buflength, int flags,
                     unsigned long dest_ip, int dest_port);
 
@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#include <sys/socket_async.h>
+
+#include "arm9/sgIP/sgIP_Hub.h"
+#include "arm9/sgIP/sgIP_sockets.h"
+
+// The queue is only used by the code that calls async_*(), never from interrupts, so it isn't
+// protected.
+static async_op *async_queue = 0;
+
+enum
+{
+    ASYNC_OP_CONNECT,
+    ASYNC_OP_ACCEPT,
+    ASYNC_OP_SEND,
+    ASYNC_OP_RECV,
+};
+
+static void async_finish(async_op *op, int result, int error)
+{
+    op->result = result;
+    op->error  = error;
+    op->state  = ASYNC_DONE;
+}
+
+// Tries to make progress on an operation. Returns 1 if it's done.
+static int async_step(async_op *op)
+{
+    int r;
+    switch (op->type)
+    {
+        case ASYNC_OP_CONNECT:
+        {
+            if (!op->transferred) // connect() hasn't been called yet
+            {
+                op->transferred = 1;
+                if (connect(op->socket, op->addr, op->length) == 0)
+                    async_finish(op, 0, 0);
+                else if (errno != EINPROGRESS)
+                    async_finish(op, -1, errno);
+                else
+                    return 0;
+                break;
+            }
+            struct pollfd pfd;
+            pfd.fd     = op->socket;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, 0) < 0)
+            {
+                async_finish(op, -1, errno);
+                break;
+            }
+            if (!pfd.revents)
+                return 0;
+            int err = 0, len = sizeof(err);
+            if (pfd.revents & POLLNVAL)
+                err = EBADF;
+            else
+                getsockopt(op->socket, SOL_SOCKET, SO_ERROR, &err, &len);
+            async_finish(op, err ? -1 : 0, err);
+            break;
+        }
+        case ASYNC_OP_ACCEPT:
+            r = accept(op->socket, op->addr, op->addr_len);
+            if (r < 0 && errno == EWOULDBLOCK)
+                return 0;
+            async_finish(op, r, r < 0 ? errno : 0);
+            break;
+        case ASYNC_OP_SEND:
+            while (op->transferred < op->length)
+            {
+                r = send(op->socket, op->buffer + op->transferred, op->length - op->transferred, 0);
+                if (r < 0)
+                {
+                    if (errno == EWOULDBLOCK)
+                        return 0;
+                    async_finish(op, -1, errno);
+                    return 1;
+                }
+                op->transferred += r;
+            }
+            async_finish(op, op->transferred, 0);
+            break;
+        case ASYNC_OP_RECV:
+            r = recv(op->socket, op->buffer, op->length, 0);
+            if (r < 0 && errno == EWOULDBLOCK)
+                return 0;
+            if (r < 0 && errno == ESHUTDOWN)
+                r = 0; // end of stream
+            async_finish(op, r, r < 0 ? errno : 0);
+            break;
+    }
+    return 1;
+}
+
+// Puts the socket of an operation that is no longer queued back in blocking mode if it was before
+// the first operation on it started. Another operation still queued on it takes over that job.
+static void async_release(async_op *op)
+{
+    if (!op->restoreblocking)
+        return;
+    op->restoreblocking = 0;
+    for (async_op *o = async_queue; o; o = o->next)
+    {
+        if (o->socket == op->socket)
+        {
+            o->restoreblocking = 1;
+            return;
+        }
+    }
+    sgIP_sockets_SetNonBlocking(op->socket, 0);
+}
+
+static int async_start(async_op *op, int type, int socket)
+{
+    int wasnonblocking = sgIP_sockets_SetNonBlocking(socket, 1);
+    if (wasnonblocking < 0)
+        return -1;
+
+    op->type            = type;
+    op->socket          = socket;
+    op->restoreblocking = !wasnonblocking;
+    op->transferred     = 0;
+    op->result          = 0;
+    op->error           = 0;
+    op->state           = ASYNC_PENDING;
+    if (async_step(op))
+    {
+        async_release(op);
+        if (op->done)
+            op->done(op);
+        return 0;
+    }
+
+    op->next    = async_queue;
+    async_queue = op;
+    return 0;
+}
+
+int async_connect(async_op *op, int socket, const struct sockaddr *addr, int addr_len)
+{
+    if (!op || op->state == ASYNC_PENDING)
+        return SGIP_ERROR(EINVAL);
+    op->addr   = (struct sockaddr *)addr;
+    op->length = addr_len;
+    return async_start(op, ASYNC_OP_CONNECT, socket);
+}
+
+int async_accept(async_op *op, int socket, struct sockaddr *addr, int *addr_len)
+{
+    if (!op || op->state == ASYNC_PENDING)
+        return SGIP_ERROR(EINVAL);
+    op->addr     = addr;
+    op->addr_len = addr_len;
+    return async_start(op, ASYNC_OP_ACCEPT, socket);
+}
+
+int async_send(async_op *op, int socket, const void *data, int length)
+{
+    if (!op || op->state == ASYNC_PENDING)
+        return SGIP_ERROR(EINVAL);
+    op->buffer = (char *)data;
+    op->length = length;
+    return async_start(op, ASYNC_OP_SEND, socket);
+}
+
+int async_recv(async_op *op, int socket, void *data, int length)
+{
+    if (!op || op->state == ASYNC_PENDING)
+        return SGIP_ERROR(EINVAL);
+    op->buffer = (char *)data;
+    op->length = length;
+    return async_start(op, ASYNC_OP_RECV, socket);
+}
+
+void async_cancel(async_op *op)
+{
+    async_op **prev = &async_queue;
+    while (*prev)
+    {
+        if (*prev == op)
+        {
+            *prev     = op->next;
+            op->state = ASYNC_IDLE;
+            async_release(op);
+            return;
+        }
+        prev = &(*prev)->next;
+    }
+}
+
+int async_run(void)
+{
+    sgIP_Hub_RunLoopback(); // packets sent to ourselves may complete some operations
+
+    unsigned int active[SGIP_SOCKET_WORDS];
+    sgIP_sockets_TakeActivity(active);
+
+    int pending     = 0;
+    async_op **prev = &async_queue;
+    while (*prev)
+    {
+        async_op *op = *prev;
+        int s        = op->socket - 1;
+        if (s < 0 || s >= SGIP_SOCKET_MAXSOCKETS || (active[s >> 5] & (1u << (s & 31))))
+        {
+            if (async_step(op))
+            {
+                *prev = op->next; // unlink before the callback, it may start a new operation
+                async_release(op);
+                if (op->done)
+                    op->done(op);
+                continue;
+            }
+        }
+        pending++;
+        prev = &op->next;
+    }
+    return pending;
+}
@@ -233,6 +233,8 @@ void sgIP_memblock_trimsize(sgIP_memblock *mb, int newsize)
     }
 }
 
+// Sums chksum_length bytes from startbyte, across the whole chain of memblocks. An odd last byte is
+// summed as if it was padded with a zero, without writing anything past the data.
 int sgIP_memblock_IPChecksum(sgIP_memblock *mb, int startbyte, int chksum_length)
 {
     int chksum_temp, offset;
@@ -355,14 +357,66 @@ int sgIP_memblock_CopyFromLinear(sgIP_memblock *mb, void *src_buf, int startbyte
     return tot_copy;
 }
 
+int sgIP_CopyToRing(void *ring, int ring_length, int pos, const void *src_buf, int copy_length)
+{
+    int first = ring_length - pos;
+    if (first > copy_length)
+        first = copy_length;
+    memcpy(((char *)ring) + pos, src_buf, first);
+    memcpy(ring, ((const char *)src_buf) + first, copy_length - first);
+    pos += copy_length;
+    if (pos >= ring_length)
+        pos -= ring_length;
+    return pos;
+}
+
+int sgIP_CopyFromRing(const void *ring, int ring_length, int pos, void *dest_buf, int copy_length)
+{
+    int first = ring_length - pos;
+    if (first > copy_length)
+        first = copy_length;
+    memcpy(dest_buf, ((const char *)ring) + pos, first);
+    memcpy(((char *)dest_buf) + first, ring, copy_length - first);
+    pos += copy_length;
+    if (pos >= ring_length)
+        pos -= ring_length;
+    return pos;
+}
+
 int sgIP_memblock_CopyBlock(sgIP_memblock *mb_src, sgIP_memblock *mb_dest, int start_src,
                             int start_dest, int copy_length)
 {
-    (void)mb_src;
-    (void)mb_dest;
-    (void)start_src;
-    (void)start_dest;
-    (void)copy_length;
-
-    return 0;
+    int copylen, ofs_dest, tot_copy;
+    ofs_dest = start_dest;
+    while (mb_dest && ofs_dest >= mb_dest->thislength)
+    {
+        ofs_dest -= mb_dest->thislength;
+        mb_dest = mb_dest->next;
+    }
+    if (!mb_dest)
+        return 0;
+    if (start_dest + copy_length > mb_dest->totallength)
+        copy_length = mb_dest->totallength - start_dest;
+    tot_copy = 0;
+    while (copy_length > 0)
+    {
+        copylen = copy_length;
+        if (copylen > mb_dest->thislength - ofs_dest)
+            copylen = mb_dest->thislength - ofs_dest;
+        copylen = sgIP_memblock_CopyToLinear(mb_src, mb_dest->datastart + ofs_dest,
+                                             start_src + tot_copy, copylen);
+        if (copylen <= 0)
+            break;
+        copy_length -= copylen;
+        tot_copy += copylen;
+        ofs_dest += copylen;
+        if (ofs_dest >= mb_dest->thislength)
+        {
+            ofs_dest = 0;
+            mb_dest  = mb_dest->next;
+            if (!mb_dest)
+                break;
+        }
+    }
+    return tot_copy;
 }
@@ -40,6 +40,11 @@ int sgIP_memblock_CopyToLinear(sgIP_memblock *mb, void *dest_buf, int startbyte,
 int sgIP_memblock_CopyFromLinear(sgIP_memblock *mb, void *src_buf, int startbyte, int copy_length);
 int sgIP_memblock_CopyBlock(sgIP_memblock *mb_src, sgIP_memblock *mb_dest, int start_src,
                             int start_dest, int copy_length);
+
+// Copies to/from a circular buffer starting at pos, in at most two memcpy() calls. They return the
+// new position in the buffer.
+int sgIP_CopyToRing(void *ring, int ring_length, int pos, const void *src_buf, int copy_length);
+int sgIP_CopyFromRing(const void *ring, int ring_length, int pos, void *dest_buf, int copy_length);
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#include "arm9/sgIP/sgIP_portalloc.h"
+
+extern unsigned long sgIP_Random(void);
+
+void sgIP_portalloc_Init(sgIP_PortAlloc *pa, unsigned int *bitmap, int first, int last)
+{
+    int n      = last - first + 1;
+    int nwords = (n + 31) / 32;
+    int nfull  = (nwords + 31) / 32;
+
+    pa->first  = first;
+    pa->last   = last;
+    pa->bitmap = bitmap;
+    pa->full   = bitmap + nwords;
+    for (int i = 0; i < nwords + nfull; i++)
+        bitmap[i] = 0;
+
+    // mark the padding at the end of the last words as used so that it's never handed out.
+    if (n & 31)
+        pa->bitmap[nwords - 1] = ~((1u << (n & 31)) - 1);
+    if (nwords & 31)
+        pa->full[nfull - 1] = ~((1u << (nwords & 31)) - 1);
+}
+
+// Marks a port (as an offset into the range) as used. Must be called protected.
+static void sgIP_portalloc_Take(sgIP_PortAlloc *pa, int ofs)
+{
+    int w = ofs >> 5;
+    pa->bitmap[w] |= 1u << (ofs & 31);
+    if (pa->bitmap[w] == 0xFFFFFFFF)
+        pa->full[w >> 5] |= 1u << (w & 31);
+}
+
+// Picks a random port and hands out the first free one from there. The search goes through the
+// bitmap of full words, so it reads at most nwords / 32 + 3 words with interrupts disabled (28 for
+// the 25000 ports of the default TCP range) instead of scanning the whole port bitmap.
+int sgIP_portalloc_Get(sgIP_PortAlloc *pa)
+{
+    int n      = pa->last - pa->first + 1;
+    int nwords = (n + 31) / 32;
+    int nfull  = (nwords + 31) / 32;
+    int ofs    = sgIP_Random() % n;
+
+    SGIP_INTR_PROTECT();
+
+    // the word of the random port, from that port on.
+    int w             = ofs >> 5;
+    unsigned int bits = pa->bitmap[w] | ((1u << (ofs & 31)) - 1);
+    if (bits == 0xFFFFFFFF)
+    {
+        // the first word after it with a free port, wrapping around (back to w itself, at worst).
+        w++;
+        if (w == nwords)
+            w = 0;
+        int f              = w >> 5;
+        unsigned int fbits = pa->full[f] | ((1u << (w & 31)) - 1);
+        for (int i = 0; fbits == 0xFFFFFFFF; i++)
+        {
+            if (i == nfull)
+            {
+                SGIP_INTR_UNPROTECT();
+                return 0; // all ports are in use
+            }
+            f++;
+            if (f == nfull)
+                f = 0;
+            fbits = pa->full[f];
+        }
+        w    = (f << 5) + __builtin_ctz(~fbits);
+        bits = pa->bitmap[w];
+    }
+    ofs = (w << 5) + __builtin_ctz(~bits);
+    sgIP_portalloc_Take(pa, ofs);
+
+    SGIP_INTR_UNPROTECT();
+    return pa->first + ofs;
+}
+
+int sgIP_portalloc_Reserve(sgIP_PortAlloc *pa, int port)
+{
+    if (port < pa->first || port > pa->last)
+        return 0;
+
+    int ofs = port - pa->first;
+    int ret = 0;
+    SGIP_INTR_PROTECT();
+    if (!(pa->bitmap[ofs >> 5] & (1u << (ofs & 31))))
+    {
+        sgIP_portalloc_Take(pa, ofs);
+        ret = 1;
+    }
+    SGIP_INTR_UNPROTECT();
+    return ret;
+}
+
+void sgIP_portalloc_Release(sgIP_PortAlloc *pa, int port)
+{
+    if (port < pa->first || port > pa->last)
+        return;
+
+    int ofs = port - pa->first;
+    SGIP_INTR_PROTECT();
+    pa->bitmap[ofs >> 5] &= ~(1u << (ofs & 31));
+    pa->full[ofs >> 10] &= ~(1u << ((ofs >> 5) & 31));
+    SGIP_INTR_UNPROTECT();
+}
@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: MIT
+
+// DSWifi Project - sgIP Internet Protocol Stack Implementation
+
+#ifndef SGIP_PORTALLOC_H
+#define SGIP_PORTALLOC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "arm9/sgIP/sgIP_Config.h"
+
+// sgIP_PortAlloc - keeps track of the ports in use in a range of ephemeral ports, one bit per
+// port. A second, smaller bitmap has one bit per word of the first one, set when the word is full,
+// so a free port is found after checking at most a few dozen words. All ports are in host byte
+// order.
+typedef struct SGIP_PORTALLOC
+{
+    int first, last;      // range of ports handled by the allocator
+    unsigned int *bitmap; // set bits are ports in use
+    unsigned int *full;   // set bits are words of bitmap with no free ports
+} sgIP_PortAlloc;
+
+// Number of words of storage needed to cover a range of ports (both bitmaps).
+#define SGIP_PORTALLOC_MAPWORDS(first, last) (((last) - (first) + 32) / 32)
+#define SGIP_PORTALLOC_WORDS(first, last) \
+    (SGIP_PORTALLOC_MAPWORDS(first, last) + (SGIP_PORTALLOC_MAPWORDS(first, last) + 31) / 32)
+
+void sgIP_portalloc_Init(sgIP_PortAlloc *pa, unsigned int *bitmap, int first, int last);
+int sgIP_portalloc_Get(sgIP_PortAlloc *pa); // returns 0 if all ports are in use
+int sgIP_portalloc_Reserve(sgIP_PortAlloc *pa, int port); // returns 1 if the port was reserved
+void sgIP_portalloc_Release(sgIP_PortAlloc *pa, int port);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -4,21 +4,113 @@
 
 // DSWifi Project - sgIP Internet Protocol Stack Implementation
 
+#include <netinet/tcp.h>
+#include <time.h>
+
 #include "arm9/sgIP/sgIP_DNS.h"
+#include "arm9/sgIP/sgIP_Hub.h"
 #include "arm9/sgIP/sgIP_ICMP.h"
 #include "arm9/sgIP/sgIP_TCP.h"
 #include "arm9/sgIP/sgIP_UDP.h"
 #include "arm9/sgIP/sgIP_sockets.h"
 
 sgIP_socket_data socketlist[SGIP_SOCKET_MAXSOCKETS];
+sgIP_epoll_set epollsets[SGIP_SOCKET_MAXEPOLL];
+volatile unsigned long sgIP_sockets_events; // incremented by every sgIP_sockets_Notify()
+unsigned int callbackpending[SGIP_SOCKET_WORDS]; // sockets whose callback needs to be run
+unsigned int activity[SGIP_SOCKET_WORDS];        // sockets with events not yet seen by async_run()
 extern unsigned long sgIP_timems;
 
 void sgIP_sockets_Init(void)
 {
     for (int i = 0; i < SGIP_SOCKET_MAXSOCKETS; i++)
     {
-        socketlist[i].conn_ptr = 0;
-        socketlist[i].flags    = 0;
+        socketlist[i].conn_ptr  = 0;
+        socketlist[i].flags     = 0;
+        socketlist[i].epollsets = 0;
+        socketlist[i].callback  = 0;
+    }
+    for (int i = 0; i < SGIP_SOCKET_MAXEPOLL; i++)
+        epollsets[i].socket = 0;
+    for (int i = 0; i < SGIP_SOCKET_WORDS; i++)
+    {
+        callbackpending[i] = 0;
+        activity[i]        = 0;
+    }
+    sgIP_sockets_events = 0;
+}
+
+// Called by the TCP and UDP code when something happens on a connection that may make its socket
+// readable or writable (data or an ACK arrived, the state changed, ...). Wakes up anything
+// waiting in select()/poll()/epoll_wait() and marks the socket to be checked by its epoll sets and
+// by socket_run_callbacks().
+void sgIP_sockets_Notify(int socket)
+{
+    SGIP_INTR_PROTECT();
+    sgIP_sockets_events++;
+    if (socket >= 1 && socket <= SGIP_SOCKET_MAXSOCKETS)
+    {
+        socket--;
+        activity[socket >> 5] |= 1u << (socket & 31);
+        if (socketlist[socket].callback)
+            callbackpending[socket >> 5] |= 1u << (socket & 31);
+        unsigned int sets = socketlist[socket].epollsets;
+        while (sets)
+        {
+            int i = __builtin_ctz(sets);
+            sets &= sets - 1;
+            epollsets[i].pending[socket >> 5] |= 1u << (socket & 31);
+        }
+    }
+    SGIP_WAKEEVENT();
+    SGIP_INTR_UNPROTECT();
+}
+
+// Called after the application has received from or accepted on a socket, so that its callback
+// gets SOCKET_EVENT_READABLE/ACCEPTED again if there is still more left. Must be called protected.
+static void sgIP_sockets_Rearm(int s)
+{
+    socketlist[s].callbacklast &= ~(SOCKET_EVENT_READABLE | SOCKET_EVENT_ACCEPTED);
+    if (socketlist[s].callback)
+        callbackpending[s >> 5] |= 1u << (s & 31);
+}
+
+// Copies the bitmap of sockets (0-based) that have had activity since the last call and clears it.
+void sgIP_sockets_TakeActivity(unsigned int *bits)
+{
+    SGIP_INTR_PROTECT();
+    for (int i = 0; i < SGIP_SOCKET_WORDS; i++)
+    {
+        bits[i]     = activity[i];
+        activity[i] = 0;
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
+// Takes a socket (0-based) that is being closed out of all epoll sets and drops its callback. If
+// it's an epoll instance itself, its set is released.
+static void sgIP_sockets_Detach(int socket)
+{
+    unsigned int bit  = 1u << (socket & 31);
+    unsigned int sets = socketlist[socket].epollsets;
+    while (sets)
+    {
+        int i = __builtin_ctz(sets);
+        sets &= sets - 1;
+        epollsets[i].interest[socket >> 5] &= ~bit;
+        epollsets[i].pending[socket >> 5] &= ~bit;
+    }
+    socketlist[socket].epollsets = 0;
+    socketlist[socket].callback  = 0;
+    callbackpending[socket >> 5] &= ~bit;
+
+    if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_EPOLL)
+    {
+        sgIP_epoll_set *set = (sgIP_epoll_set *)socketlist[socket].conn_ptr;
+        unsigned int setbit = 1 << (set - epollsets);
+        for (int i = 0; i < SGIP_SOCKET_MAXSOCKETS; i++)
+            socketlist[i].epollsets &= ~setbit;
+        set->socket = 0;
     }
 }
 
@@ -55,6 +147,22 @@ void sgIP_sockets_Timer1000ms(void)
     SGIP_INTR_UNPROTECT();
 }
 
+// Called by the TCP code when a connection is done with its record. If the user has already closed
+// the socket that owns it, free it now instead of waiting for the timer to clean it up.
+void sgIP_sockets_ReleaseTCPRecord(sgIP_Record_TCP *rec)
+{
+    SGIP_INTR_PROTECT();
+    for (int i = 0; i < SGIP_SOCKET_MAXSOCKETS; i++)
+    {
+        if ((socketlist[i].flags & SGIP_SOCKET_FLAG_CLOSING) && socketlist[i].conn_ptr == rec)
+        {
+            forceclosesocket(i + 1);
+            break;
+        }
+    }
+    SGIP_INTR_UNPROTECT();
+}
+
 // spawn/kill socket for internal use ONLY.
 int spawn_socket(int flags)
 {
@@ -68,8 +176,10 @@ int spawn_socket(int flags)
         SGIP_INTR_UNPROTECT();
         return SGIP_ERROR(ENOMEM);
     }
-    socketlist[s].flags    = SGIP_SOCKET_FLAG_ALLOCATED | SGIP_SOCKET_FLAG_VALID | flags;
-    socketlist[s].conn_ptr = 0;
+    socketlist[s].flags     = SGIP_SOCKET_FLAG_ALLOCATED | SGIP_SOCKET_FLAG_VALID | flags;
+    socketlist[s].conn_ptr  = 0;
+    socketlist[s].epollsets = 0;
+    socketlist[s].callback  = 0;
     SGIP_INTR_UNPROTECT();
     return s + 1;
 }
@@ -81,6 +191,7 @@ int kill_socket(int s)
 
     SGIP_INTR_PROTECT();
     s--;
+    sgIP_sockets_Detach(s);
     socketlist[s].conn_ptr = 0;
     socketlist[s].flags    = 0;
     SGIP_INTR_UNPROTECT();
@@ -132,6 +243,12 @@ int socket(int domain, int type, int protocol)
         SGIP_INTR_UNPROTECT();
         return SGIP_ERROR(ENOMEM);
     }
+    socketlist[s].epollsets = 0;
+    socketlist[s].callback  = 0;
+    if (type == SOCK_STREAM)
+        ((sgIP_Record_TCP *)socketlist[s].conn_ptr)->socket = s + 1;
+    else
+        ((sgIP_Record_UDP *)socketlist[s].conn_ptr)->socket = s + 1;
 #ifdef SGIP_SOCKET_DEFAULT_NONBLOCK
     socketlist[s].flags |= SGIP_SOCKET_FLAG_NONBLOCKING;
 #endif
@@ -151,6 +268,7 @@ int forceclosesocket(int socket)
         SGIP_INTR_UNPROTECT();
         return 0;
     }
+    sgIP_sockets_Detach(socket);
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
         sgIP_TCP_FreeRecord((sgIP_Record_TCP *)socketlist[socket].conn_ptr);
@@ -177,6 +295,7 @@ int closesocket(int socket)
         SGIP_INTR_UNPROTECT();
         return 0;
     }
+    sgIP_sockets_Detach(socket);
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
         // TCP is special.
@@ -281,12 +400,19 @@ int connect(int socket, const struct sockaddr *addr, int addr_len)
                     (void)SGIP_ERROR(EINPROGRESS);
                     break;
                 }
-                SGIP_INTR_UNPROTECT();
-                SGIP_WAITEVENT();
-                SGIP_INTR_REPROTECT();
+                SGIP_INTR_WAITEVENT();
             } while (1);
         }
     }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        // AF_UNSPEC dissolves the association.
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+        sgIP_Record_UDP *rec          = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+
+        retval = sgIP_UDP_Connect(rec, sin->sin_addr.s_addr,
+                                  sin->sin_family == AF_UNSPEC ? 0 : sin->sin_port);
+    }
     SGIP_INTR_UNPROTECT();
     return retval;
 }
@@ -318,11 +444,17 @@ int send(int socket, const void *data, int sendlength, int flags)
                 break;
             if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                 break;
-            SGIP_INTR_UNPROTECT();
-            SGIP_WAITEVENT();
-            SGIP_INTR_REPROTECT();
+            SGIP_INTR_WAITEVENT();
         } while (1);
     }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+        if (!rec->destport)
+            retval = SGIP_ERROR(ENOTCONN);
+        else
+            retval = sgIP_UDP_SendTo(rec, data, sendlength, flags, rec->destip, rec->destport);
+    }
     SGIP_INTR_UNPROTECT();
     return retval;
 }
@@ -352,11 +484,27 @@ int recv(int socket, void *data, int recvlength, int flags)
                 break;
             if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                 break;
-            SGIP_INTR_UNPROTECT();
-            SGIP_WAITEVENT();
-            SGIP_INTR_REPROTECT();
+            SGIP_INTR_WAITEVENT();
+        } while (1);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        unsigned long sender_ip;
+        unsigned short sender_port;
+        do
+        {
+            retval = sgIP_UDP_RecvFrom((sgIP_Record_UDP *)socketlist[socket].conn_ptr, data,
+                                       recvlength, flags, &sender_ip, &sender_port);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            SGIP_INTR_WAITEVENT();
         } while (1);
     }
+    sgIP_sockets_Rearm(socket);
     SGIP_INTR_UNPROTECT();
     return retval;
 }
@@ -382,6 +530,28 @@ int sendto(int socket, const void *data, int sendlength, int flags, const struct
 
     if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
+        if (flags & MSG_FASTOPEN)
+        {
+            // connect, with the data going out on the SYN if we have a cookie for this server.
+            sgIP_Record_TCP *rec = (sgIP_Record_TCP *)socketlist[socket].conn_ptr;
+
+            retval = sgIP_TCP_FastOpenConnect(rec, data, sendlength,
+                                              ((struct sockaddr_in *)addr)->sin_addr.s_addr,
+                                              ((struct sockaddr_in *)addr)->sin_port);
+            while (retval >= 0 && !(socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING))
+            {
+                int i = rec->tcpstate;
+                if (i == SGIP_TCP_STATE_ESTABLISHED || i == SGIP_TCP_STATE_CLOSE_WAIT)
+                    break;
+                if (i == SGIP_TCP_STATE_CLOSED || i == SGIP_TCP_STATE_UNUSED
+                    || i == SGIP_TCP_STATE_LISTEN || i == SGIP_TCP_STATE_NODATA)
+                {
+                    retval = SGIP_ERROR(rec->errorcode);
+                    break;
+                }
+                SGIP_INTR_WAITEVENT();
+            }
+        }
     }
     else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
     {
@@ -428,17 +598,291 @@ int recvfrom(int socket, void *data, int recvlength, int flags, struct sockaddr
                 break;
             if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                 break;
-            SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
-            SGIP_WAITEVENT();      // don't just try again immediately
-            SGIP_INTR_REPROTECT();
+            SGIP_INTR_WAITEVENT();
         } while (1);
         *addr_len = sizeof(struct sockaddr_in);
     }
 
+    sgIP_sockets_Rearm(socket);
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
+// Fills the buffers in order from the receive buffer of a TCP connection, stopping at the first
+// one that can't be filled completely.
+static int sgIP_sockets_TCPRecvV(sgIP_Record_TCP *rec, const struct iovec *iov, int iovcnt,
+                                 int flags)
+{
+    int total = 0;
+    for (int v = 0; v < iovcnt; v++)
+    {
+        if (iov[v].iov_len == 0)
+            continue;
+        int r = sgIP_TCP_Recv(rec, iov[v].iov_base, iov[v].iov_len, flags);
+        if (r < 0)
+            return total ? total : r;
+        total += r;
+        if (r < (int)iov[v].iov_len || (flags & MSG_PEEK))
+            break; // peeking again would return the same data
+    }
+    return total;
+}
+
+// Stores the sender of a received datagram in msg->msg_name, if there is room for it.
+static void sgIP_sockets_SetMsgName(struct msghdr *msg, struct sockaddr_in *sender)
+{
+    if (sender && msg->msg_name && msg->msg_namelen >= (int)sizeof(struct sockaddr_in))
+    {
+        sender->sin_family                   = AF_INET;
+        *(struct sockaddr_in *)msg->msg_name = *sender;
+        msg->msg_namelen                     = sizeof(struct sockaddr_in);
+    }
+    else
+    {
+        msg->msg_namelen = 0;
+    }
+}
+
+int sendmsg(int socket, const struct msghdr *msg, int flags)
+{
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+    if (!msg || msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX
+        || (!msg->msg_iov && msg->msg_iovlen))
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    int retval = SGIP_ERROR(EINVAL);
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+
+    if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+    {
+        do
+        {
+            retval = sgIP_TCP_SendV((sgIP_Record_TCP *)socketlist[socket].conn_ptr, msg->msg_iov,
+                                    msg->msg_iovlen, flags);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            SGIP_INTR_WAITEVENT();
+        } while (1);
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        sgIP_Record_UDP *rec     = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+        struct sockaddr_in *addr = (struct sockaddr_in *)msg->msg_name;
+        if (addr)
+            retval = sgIP_UDP_SendPacketV(rec, msg->msg_iov, msg->msg_iovlen,
+                                          addr->sin_addr.s_addr, addr->sin_port);
+        else if (rec->destport)
+            retval = sgIP_UDP_SendPacketV(rec, msg->msg_iov, msg->msg_iovlen, rec->destip,
+                                          rec->destport);
+        else
+            retval = SGIP_ERROR(EDESTADDRREQ);
+    }
+
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
+int recvmsg(int socket, struct msghdr *msg, int flags)
+{
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+    if (!msg || msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX
+        || (!msg->msg_iov && msg->msg_iovlen))
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    int retval = SGIP_ERROR(EINVAL);
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+    msg->msg_controllen = 0;
+    msg->msg_flags      = 0;
+
+    if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+    {
+        do
+        {
+            retval = sgIP_sockets_TCPRecvV((sgIP_Record_TCP *)socketlist[socket].conn_ptr,
+                                           msg->msg_iov, msg->msg_iovlen, flags);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            SGIP_INTR_WAITEVENT();
+        } while (1);
+        msg->msg_namelen = 0;
+    }
+    else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        struct sockaddr_in sender;
+        do
+        {
+            retval = sgIP_UDP_RecvFromV((sgIP_Record_UDP *)socketlist[socket].conn_ptr,
+                                        msg->msg_iov, msg->msg_iovlen, flags,
+                                        &sender.sin_addr.s_addr, &sender.sin_port);
+            if (retval != -1)
+                break;
+            if (errno != EWOULDBLOCK)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            SGIP_INTR_WAITEVENT();
+        } while (1);
+        sgIP_sockets_SetMsgName(msg, retval >= 0 ? &sender : 0);
+    }
+
+    sgIP_sockets_Rearm(socket);
     SGIP_INTR_UNPROTECT();
     return retval;
 }
 
+// Sends all the datagrams under a single critical section, and lets the hardware interface start
+// transmitting them all at once at the end.
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags)
+{
+    (void)flags;
+
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+    if (!msgvec && vlen)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) != SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+    sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+
+    int retval, error = 0;
+    unsigned int n;
+    sgIP_Hub_BeginBatch();
+    for (n = 0; n < vlen; n++)
+    {
+        struct msghdr *msg       = &msgvec[n].msg_hdr;
+        struct sockaddr_in *addr = (struct sockaddr_in *)msg->msg_name;
+        if (msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX || (!msg->msg_iov && msg->msg_iovlen))
+            retval = SGIP_ERROR(EINVAL);
+        else if (addr)
+            retval = sgIP_UDP_SendPacketV(rec, msg->msg_iov, msg->msg_iovlen,
+                                          addr->sin_addr.s_addr, addr->sin_port);
+        else if (rec->destport)
+            retval = sgIP_UDP_SendPacketV(rec, msg->msg_iov, msg->msg_iovlen, rec->destip,
+                                          rec->destport);
+        else
+            retval = SGIP_ERROR(EDESTADDRREQ);
+        if (retval < 0)
+        {
+            error = errno;
+            break;
+        }
+        msgvec[n].msg_len = retval;
+    }
+    sgIP_Hub_EndBatch();
+    SGIP_INTR_UNPROTECT();
+
+    if (n == 0 && vlen)
+        return SGIP_ERROR(error);
+    return n;
+}
+
+// Waits (unless the socket is non-blocking) for the first datagram, then takes all the datagrams
+// that are already queued, up to vlen, under a single critical section.
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout)
+{
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+    if (!msgvec && vlen)
+        return SGIP_ERROR(EINVAL);
+
+    unsigned long timeout_ms = 2678400000UL; // 31 days, in ms
+    unsigned long starttime  = sgIP_timems;
+    if (timeout && timeout->tv_sec < 2678400)
+        timeout_ms = timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000;
+
+    SGIP_INTR_PROTECT();
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) != SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+    sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+
+    int retval, error = 0;
+    unsigned int n = 0;
+    while (n < vlen)
+    {
+        struct msghdr *msg = &msgvec[n].msg_hdr;
+        struct sockaddr_in sender;
+        if (msg->msg_iovlen < 0 || msg->msg_iovlen > IOV_MAX || (!msg->msg_iov && msg->msg_iovlen))
+            retval = SGIP_ERROR(EINVAL);
+        else
+            retval = sgIP_UDP_RecvFromV(rec, msg->msg_iov, msg->msg_iovlen, flags,
+                                        &sender.sin_addr.s_addr, &sender.sin_port);
+        if (retval < 0)
+        {
+            error = errno;
+            if (error != EWOULDBLOCK || n > 0)
+                break;
+            if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
+                break;
+            if (sgIP_timems - starttime >= timeout_ms)
+                break;
+            SGIP_INTR_WAITEVENT();
+            continue;
+        }
+        msg->msg_controllen = 0;
+        msg->msg_flags      = 0;
+        sgIP_sockets_SetMsgName(msg, &sender);
+        msgvec[n].msg_len = retval;
+        n++;
+    }
+    sgIP_sockets_Rearm(socket);
+    SGIP_INTR_UNPROTECT();
+
+    if (n == 0 && vlen)
+        return SGIP_ERROR(error);
+    return n;
+}
+
+int writev(int socket, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = { 0 };
+    msg.msg_iov       = (struct iovec *)iov;
+    msg.msg_iovlen    = iovcnt;
+    return sendmsg(socket, &msg, 0);
+}
+
+int readv(int socket, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = { 0 };
+    msg.msg_iov       = (struct iovec *)iov;
+    msg.msg_iovlen    = iovcnt;
+    return recvmsg(socket, &msg, 0);
+}
+
 int listen(int socket, int max_connections)
 {
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
@@ -492,9 +936,7 @@ int accept(int socket, struct sockaddr *addr, int *addr_len)
                     break;
                 if (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING)
                     break;
-                SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
-                SGIP_WAITEVENT();      // don't just try again immediately
-                SGIP_INTR_REPROTECT();
+                SGIP_INTR_WAITEVENT();
             } while (1);
         }
         if (ret == 0)
@@ -511,10 +953,12 @@ int accept(int socket, struct sockaddr *addr, int *addr_len)
             ((struct sockaddr_in *)addr)->sin_addr.s_addr = ret->destip;
 
             socketlist[s - 1].conn_ptr = ret;
+            ret->socket                = s;
 
             retval = s;
         }
     }
+    sgIP_sockets_Rearm(socket);
     SGIP_INTR_UNPROTECT();
     return retval;
 }
@@ -543,6 +987,28 @@ int shutdown(int socket, int shutdown_type)
     return retval;
 }
 
+// Like ioctl(FIONBIO), but returns whether the socket was non-blocking before (or -1 on error), so
+// that the caller can put it back the way it was.
+int sgIP_sockets_SetNonBlocking(int socket, int nonblocking)
+{
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EBADF);
+
+    socket--;
+    SGIP_INTR_PROTECT();
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+    int old = (socketlist[socket].flags & SGIP_SOCKET_FLAG_NONBLOCKING) != 0;
+    socketlist[socket].flags &= ~SGIP_SOCKET_FLAG_NONBLOCKING;
+    if (nonblocking)
+        socketlist[socket].flags |= SGIP_SOCKET_FLAG_NONBLOCKING;
+    SGIP_INTR_UNPROTECT();
+    return old;
+}
+
 int ioctl(int socket, long cmd, void *arg)
 {
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
@@ -620,27 +1086,172 @@ int ioctl(int socket, long cmd, void *arg)
 
 int setsockopt(int socket, int level, int option_name, const void *data, int data_len)
 {
-    (void)socket;
-    (void)level;
-    (void)option_name;
-    (void)data;
-    (void)data_len;
-
-    return 0;
-}
-
-int getsockopt(int socket, int level, int option_name, void *data, int *data_len)
-{
-    (void)socket;
-    (void)level;
-    (void)option_name;
-    (void)data;
-    (void)data_len;
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
 
-    return 0;
-}
+    if (level == SOL_TCP && option_name == TCP_FASTOPEN)
+    {
+        if (!data || data_len < (int)sizeof(int))
+            return SGIP_ERROR(EINVAL);
 
-int getpeername(int socket, struct sockaddr *addr, int *addr_len)
+        SGIP_INTR_PROTECT();
+        int retval = SGIP_ERROR(ENOPROTOOPT);
+        socket--;
+        if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EINVAL);
+        }
+        if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+        {
+            retval = sgIP_TCP_SetFastOpen((sgIP_Record_TCP *)socketlist[socket].conn_ptr,
+                                          *(const int *)data > 0);
+        }
+        SGIP_INTR_UNPROTECT();
+        return retval;
+    }
+
+    if (level == SOL_SOCKET && (option_name == SO_RCVBUF || option_name == SO_DROPPOLICY))
+    {
+        if (!data || data_len < (int)sizeof(int))
+            return SGIP_ERROR(EINVAL);
+
+        int value = *(const int *)data;
+        SGIP_INTR_PROTECT();
+        int retval = 0;
+        socket--;
+        if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EINVAL);
+        }
+        if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+        {
+            sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+            if (option_name == SO_RCVBUF)
+            {
+                // datagrams already queued are kept, the limit applies to new ones.
+                if (value < 0)
+                    value = 0;
+                if (value > SGIP_UDP_RCVBUF_MAX)
+                    value = SGIP_UDP_RCVBUF_MAX;
+                rec->rcvbuf = value;
+            }
+            else if (value == SO_DROP_NEWEST || value == SO_DROP_OLDEST)
+            {
+                rec->droppolicy = value;
+            }
+            else
+            {
+                retval = SGIP_ERROR(EINVAL);
+            }
+        }
+        SGIP_INTR_UNPROTECT();
+        return retval;
+    }
+
+    // other options are accepted, but ignored.
+    return 0;
+}
+
+int getsockopt(int socket, int level, int option_name, void *data, int *data_len)
+{
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+
+    if (level == SOL_SOCKET && option_name == SO_ERROR)
+    {
+        if (!data || !data_len || *data_len < (int)sizeof(int))
+            return SGIP_ERROR(EINVAL);
+
+        SGIP_INTR_PROTECT();
+        socket--;
+        if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EINVAL);
+        }
+        *(int *)data = 0;
+        if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+        {
+            // report the pending error (e.g. the result of a non-blocking connect) and clear it.
+            sgIP_Record_TCP *rec = (sgIP_Record_TCP *)socketlist[socket].conn_ptr;
+            *(int *)data         = rec->errorcode;
+            rec->errorcode       = 0;
+        }
+        else if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK)
+                 == SGIP_SOCKET_FLAG_TYPE_UDP)
+        {
+            sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+            *(int *)data         = rec->errorcode;
+            rec->errorcode       = 0;
+        }
+        *data_len = sizeof(int);
+        SGIP_INTR_UNPROTECT();
+        return 0;
+    }
+
+    if (level == SOL_SOCKET
+        && (option_name == SO_RCVBUF || option_name == SO_DROPPOLICY
+            || option_name == SO_DROPCOUNT))
+    {
+        if (!data || !data_len || *data_len < (int)sizeof(int))
+            return SGIP_ERROR(EINVAL);
+
+        SGIP_INTR_PROTECT();
+        int retval = SGIP_ERROR(ENOPROTOOPT);
+        socket--;
+        if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EINVAL);
+        }
+        if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+        {
+            sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[socket].conn_ptr;
+            if (option_name == SO_RCVBUF)
+                *(int *)data = rec->rcvbuf;
+            else if (option_name == SO_DROPPOLICY)
+                *(int *)data = rec->droppolicy;
+            else
+                *(int *)data = rec->dropped;
+            *data_len = sizeof(int);
+            retval    = 0;
+        }
+        else if (option_name == SO_RCVBUF)
+        {
+            *(int *)data = SGIP_TCP_RECEIVEBUFFERLENGTH;
+            *data_len    = sizeof(int);
+            retval       = 0;
+        }
+        SGIP_INTR_UNPROTECT();
+        return retval;
+    }
+
+    if (level == SOL_TCP && option_name == TCP_INFO)
+    {
+        SGIP_INTR_PROTECT();
+        int retval = SGIP_ERROR(ENOPROTOOPT);
+        socket--;
+        if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID))
+        {
+            SGIP_INTR_UNPROTECT();
+            return SGIP_ERROR(EINVAL);
+        }
+        if ((socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+        {
+            retval = sgIP_TCP_GetInfo((sgIP_Record_TCP *)socketlist[socket].conn_ptr, data,
+                                      data_len);
+        }
+        SGIP_INTR_UNPROTECT();
+        return retval;
+    }
+
+    // other options aren't supported yet.
+    return 0;
+}
+
+int getpeername(int socket, struct sockaddr *addr, int *addr_len)
 {
     if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
         return SGIP_ERROR(EBADF);
@@ -755,198 +1366,457 @@ struct hostent *gethostbyname(const char *name)
     return (struct hostent *)sgIP_DNS_gethostbyname(name);
 };
 
+// A TCP socket is writable when it's connected and there is space in its transmit buffer. A
+// connection attempt that has failed also counts as writable, getsockopt(SO_ERROR) tells why.
+static int sgIP_sockets_TCPWritable(sgIP_Record_TCP *rec)
+{
+    if (rec->tcpstate == SGIP_TCP_STATE_SYN_SENT || rec->tcpstate == SGIP_TCP_STATE_SYN_RECEIVED)
+        return 0;
+    if (rec->tcpstate == SGIP_TCP_STATE_CLOSED)
+        return 1;
+
+    int j = rec->buf_tx_in - 1;
+    if (j < 0)
+        j = SGIP_TCP_TRANSMITBUFFERLENGTH - 1;
+    return rec->buf_tx_out != j;
+}
+
+// Works out which POLL* events are pending on a socket (0-based). This is cheap, so readiness is
+// always computed from the connection state instead of being cached.
+static int sgIP_sockets_Readiness(int s)
+{
+    int events = 0;
+    if (!(socketlist[s].flags & SGIP_SOCKET_FLAG_VALID))
+        return POLLNVAL;
+
+    if ((socketlist[s].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
+    {
+        sgIP_Record_TCP *rec = (sgIP_Record_TCP *)socketlist[s].conn_ptr;
+        if (rec->tcpstate == SGIP_TCP_STATE_LISTEN)
+        {
+            if (rec->listendata && rec->listendata[0])
+                events |= POLLIN;
+            return events;
+        }
+        if (rec->buf_rx_in != rec->buf_rx_out || rec->tcpstate == SGIP_TCP_STATE_CLOSED
+            || (rec->tcpstate == SGIP_TCP_STATE_CLOSE_WAIT && rec->want_shutdown == 0))
+            events |= POLLIN;
+        if (sgIP_sockets_TCPWritable(rec))
+            events |= POLLOUT;
+        if (rec->tcpstate == SGIP_TCP_STATE_CLOSED)
+            events |= POLLHUP;
+        if (rec->errorcode)
+            events |= POLLERR;
+    }
+    else if ((socketlist[s].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        sgIP_Record_UDP *rec = (sgIP_Record_UDP *)socketlist[s].conn_ptr;
+        if (rec->incoming_queue || rec->errorcode)
+            events |= POLLIN;
+        events |= POLLOUT;
+        if (rec->errorcode)
+            events |= POLLERR;
+    }
+    return events;
+}
+
+#define SGIP_SOCKET_WAIT_FOREVER 2678400000UL // 31 days, in ms
+
+// Waits (with interrupts enabled) until sgIP_sockets_Notify() has been called since the event
+// count was 'seen', or until timeout_ms have passed since 'start'. Returns 0 on timeout.
+static int sgIP_sockets_WaitEvent(unsigned long seen, unsigned long start,
+                                  unsigned long timeout_ms)
+{
+    while (sgIP_sockets_events == seen)
+    {
+        if (sgIP_timems - start >= timeout_ms)
+            return 0;
+        SGIP_WAITEVENT(seen);
+    }
+    return 1;
+}
+
 int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout)
 {
     // 31 days = 2678400 seconds
-    unsigned long timeout_ms, lasttime, temp;
-    sgIP_Record_TCP *rec;
-    sgIP_Record_UDP *urec;
-    lasttime = sgIP_timems;
+    unsigned long timeout_ms, starttime, seen;
+    starttime = sgIP_timems;
     if (!timeout)
-        timeout_ms = 2678400000UL;
+        timeout_ms = SGIP_SOCKET_WAIT_FOREVER;
     else
     {
         if (timeout->tv_sec >= 2678400)
         {
-            timeout_ms = 2678400000UL;
+            timeout_ms = SGIP_SOCKET_WAIT_FOREVER;
         }
         else
         {
             timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec / 1000);
         }
     }
+    // sockets are numbered from 1, only the ones below nfds are checked.
+    if (nfds > SGIP_SOCKET_MAXSOCKETS + 1)
+        nfds = SGIP_SOCKET_MAXSOCKETS + 1;
+
+    sgIP_Hub_RunLoopback(); // receive packets sent to ourselves before checking the sockets
     SGIP_INTR_PROTECT();
-    nfds = SGIP_SOCKET_MAXSOCKETS;
+    int i, events, retval;
+    while (1) // check all fd sets, only scanning again once something has happened.
+    {
+        seen   = sgIP_sockets_events;
+        retval = 0;
+        for (i = 0; i + 1 < nfds; i++)
+        {
+            if (readfds && FD_ISSET(i + 1, readfds) && (sgIP_sockets_Readiness(i) & POLLIN))
+                retval++;
+            if (writefds && FD_ISSET(i + 1, writefds) && (sgIP_sockets_Readiness(i) & POLLOUT))
+                retval++;
+        }
+        if (retval)
+            break;
 
-    int i, j, retval;
-    while (timeout_ms > 0) // check all fd sets
+        SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
+        i = sgIP_sockets_WaitEvent(seen, starttime, timeout_ms);
+        SGIP_INTR_REPROTECT();
+        if (!i)
+            break;
+    }
+
+    // markup fd sets and return
+    for (i = 0; i + 1 < nfds; i++)
+    {
+        events = sgIP_sockets_Readiness(i);
+        if (readfds && !(events & POLLIN))
+            FD_CLR(i + 1, readfds);
+        if (writefds && !(events & POLLOUT))
+            FD_CLR(i + 1, writefds);
+    }
+    for (; i < SGIP_SOCKET_MAXSOCKETS; i++)
     {
-        // readfds
         if (readfds)
+            FD_CLR(i + 1, readfds);
+        if (writefds)
+            FD_CLR(i + 1, writefds);
+    }
+
+    // errorfds
+    // ignore errorfds for now.
+    if (errorfds)
+    {
+        FD_ZERO(errorfds);
+    }
+
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    if (!fds && nfds)
+        return SGIP_ERROR(EINVAL);
+
+    unsigned long starttime = sgIP_timems;
+    unsigned long seen;
+    int i, events, retval;
+
+    sgIP_Hub_RunLoopback(); // receive packets sent to ourselves before checking the sockets
+    SGIP_INTR_PROTECT();
+    while (1)
+    {
+        seen   = sgIP_sockets_events;
+        retval = 0;
+        for (i = 0; i < (int)nfds; i++)
         {
-            for (i = 0; i < nfds; i++)
-            {
-                if (FD_ISSET(i + 1, readfds))
-                {
-                    if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
-                        == SGIP_SOCKET_FLAG_TYPE_TCP)
-                    {
-                        rec = (sgIP_Record_TCP *)socketlist[i].conn_ptr;
-                        if (rec->tcpstate == SGIP_TCP_STATE_LISTEN && rec->listendata
-                            && rec->listendata[0])
-                        {
-                            timeout_ms = 0;
-                            break;
-                        }
-                        if (rec->tcpstate == SGIP_TCP_STATE_CLOSED
-                            || (rec->tcpstate == SGIP_TCP_STATE_CLOSE_WAIT
-                                && rec->want_shutdown == 0))
-                        {
-                            timeout_ms = 0;
-                            break;
-                        }
-                        if (rec->buf_rx_in != rec->buf_rx_out)
-                        {
-                            timeout_ms = 0;
-                            break;
-                        }
-                    }
-                    else if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
-                             == SGIP_SOCKET_FLAG_TYPE_UDP)
-                    {
-                        urec = (sgIP_Record_UDP *)socketlist[i].conn_ptr;
-                        if (urec->incoming_queue)
-                        {
-                            timeout_ms = 0;
-                            break;
-                        }
-                    }
-                }
-            }
-            if (timeout_ms == 0)
-                break;
+            fds[i].revents = 0;
+            if (fds[i].fd < 0)
+                continue; // ignored, as per POSIX
+            if (fds[i].fd < 1 || fds[i].fd > SGIP_SOCKET_MAXSOCKETS)
+                events = POLLNVAL;
+            else
+                events = sgIP_sockets_Readiness(fds[i].fd - 1);
+            fds[i].revents = events & (fds[i].events | POLLERR | POLLHUP | POLLNVAL);
+            if (fds[i].revents)
+                retval++;
         }
-        if (writefds)
+        if (retval || timeout == 0)
+            break;
+
+        SGIP_INTR_UNPROTECT();
+        i = sgIP_sockets_WaitEvent(seen, starttime,
+                                   timeout < 0 ? SGIP_SOCKET_WAIT_FOREVER : timeout);
+        SGIP_INTR_REPROTECT();
+        if (!i)
+            break;
+    }
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
+
+int epoll_create(int size)
+{
+    if (size <= 0)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    int i, s;
+    for (i = 0; i < SGIP_SOCKET_MAXEPOLL; i++)
+    {
+        if (!epollsets[i].socket)
+            break;
+    }
+    if (i == SGIP_SOCKET_MAXEPOLL)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(ENOMEM);
+    }
+    s = spawn_socket(SGIP_SOCKET_FLAG_TYPE_EPOLL);
+    if (s > 0)
+    {
+        sgIP_epoll_set *set = &epollsets[i];
+        set->socket         = s;
+        for (int w = 0; w < SGIP_SOCKET_WORDS; w++)
         {
-            // writefds
-            for (i = 0; i < nfds; i++)
+            set->interest[w] = 0;
+            set->pending[w]  = 0;
+        }
+        socketlist[s - 1].conn_ptr = set;
+    }
+    SGIP_INTR_UNPROTECT();
+    return s;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    if (epfd < 1 || epfd > SGIP_SOCKET_MAXSOCKETS || fd < 1 || fd > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EBADF);
+    if (op != EPOLL_CTL_DEL && !event)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    epfd--;
+    fd--;
+    if (!(socketlist[epfd].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[epfd].flags & SGIP_SOCKET_FLAG_TYPEMASK) != SGIP_SOCKET_FLAG_TYPE_EPOLL
+        || !(socketlist[fd].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[fd].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_EPOLL)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
+    }
+
+    sgIP_epoll_set *set = (sgIP_epoll_set *)socketlist[epfd].conn_ptr;
+    unsigned int setbit = 1 << (set - epollsets);
+    unsigned int bit    = 1u << (fd & 31);
+    int registered      = (set->interest[fd >> 5] & bit) != 0;
+    int retval          = 0;
+    switch (op)
+    {
+        case EPOLL_CTL_ADD:
+        case EPOLL_CTL_MOD:
+            if (registered == (op == EPOLL_CTL_ADD))
             {
-                if (FD_ISSET(i + 1, writefds))
-                {
-                    if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
-                        == SGIP_SOCKET_FLAG_TYPE_TCP)
-                    {
-                        rec = (sgIP_Record_TCP *)socketlist[i].conn_ptr;
-                        j   = rec->buf_tx_in - 1;
-                        if (j < 0)
-                            j = SGIP_TCP_TRANSMITBUFFERLENGTH - 1;
-                        if (rec->buf_tx_out != j)
-                        {
-                            timeout_ms = 0;
-                            break;
-                        }
-                    }
-                }
+                retval = SGIP_ERROR(registered ? EEXIST : ENOENT);
+                break;
             }
-            if (timeout_ms == 0)
+            set->events[fd] = *event; // assume struct copy
+            set->interest[fd >> 5] |= bit;
+            set->pending[fd >> 5] |= bit; // check it on the next epoll_wait
+            socketlist[fd].epollsets |= setbit;
+            break;
+        case EPOLL_CTL_DEL:
+            if (!registered)
+            {
+                retval = SGIP_ERROR(ENOENT);
                 break;
-        }
-        // errorfds
-        // ignore errorfds for now.
+            }
+            set->interest[fd >> 5] &= ~bit;
+            set->pending[fd >> 5] &= ~bit;
+            socketlist[fd].epollsets &= ~setbit;
+            break;
+        default:
+            retval = SGIP_ERROR(EINVAL);
+            break;
+    }
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
 
-        temp = sgIP_timems - lasttime;
-        if (timeout_ms < temp)
-            timeout_ms = 0;
-        else
-            timeout_ms -= temp;
-        lasttime += temp;
-        SGIP_INTR_UNPROTECT(); // give interrupts a chance to occur.
-        SGIP_WAITEVENT();      // don't just try again immediately
-        SGIP_INTR_REPROTECT();
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+    if (epfd < 1 || epfd > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EBADF);
+    if (!events || maxevents <= 0)
+        return SGIP_ERROR(EINVAL);
+
+    unsigned long starttime = sgIP_timems;
+    unsigned long seen;
+    unsigned int bits, mask;
+    int w, s, ready, retval;
+
+    sgIP_Hub_RunLoopback(); // receive packets sent to ourselves before checking the sockets
+    SGIP_INTR_PROTECT();
+    epfd--;
+    if (!(socketlist[epfd].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[epfd].flags & SGIP_SOCKET_FLAG_TYPEMASK) != SGIP_SOCKET_FLAG_TYPE_EPOLL)
+    {
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
     }
-    // markup fd sets and return
-    // readfds
-    retval = 0;
-    if (readfds)
+    sgIP_epoll_set *set = (sgIP_epoll_set *)socketlist[epfd].conn_ptr;
+
+    while (1)
     {
-        for (i = 0; i < nfds; i++)
+        // only the sockets that have had an event, or were ready last time, need to be checked.
+        seen   = sgIP_sockets_events;
+        retval = 0;
+        for (w = 0; w < SGIP_SOCKET_WORDS && retval < maxevents; w++)
         {
-            if (FD_ISSET(i + 1, readfds))
+            bits = set->pending[w];
+            while (bits && retval < maxevents)
             {
-                if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
-                {
-                    rec = (sgIP_Record_TCP *)socketlist[i].conn_ptr;
-                    if (rec->tcpstate == SGIP_TCP_STATE_LISTEN && rec->listendata
-                        && rec->listendata[0])
-                    {
-                        retval++;
-                    }
-                    else if (rec->tcpstate == SGIP_TCP_STATE_CLOSED
-                             || (rec->tcpstate == SGIP_TCP_STATE_CLOSE_WAIT
-                                 && rec->want_shutdown == 0))
-                    {
-                        retval++;
-                    }
-                    else if (rec->buf_rx_in == rec->buf_rx_out)
-                    {
-                        FD_CLR(i + 1, readfds);
-                    }
-                    else
-                    {
-                        retval++;
-                    }
-                }
-                else if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK)
-                         == SGIP_SOCKET_FLAG_TYPE_UDP)
-                {
-                    urec = (sgIP_Record_UDP *)socketlist[i].conn_ptr;
-                    if (!urec->incoming_queue)
-                    {
-                        FD_CLR(i + 1, readfds);
-                    }
-                    else
-                    {
-                        retval++;
-                    }
-                }
+                s = __builtin_ctz(bits);
+                bits &= bits - 1;
+                mask = set->events[w * 32 + s].events;
+                s += w * 32;
+
+                ready = 0;
+                if (mask & ~(EPOLLET | EPOLLONESHOT))
+                    ready = sgIP_sockets_Readiness(s) & (mask | EPOLLERR | EPOLLHUP);
+                if (!ready || (mask & (EPOLLET | EPOLLONESHOT)))
+                    set->pending[w] &= ~(1u << (s & 31)); // wait for the next event
+                if (!ready)
+                    continue;
+
+                events[retval].events = ready;
+                events[retval].data   = set->events[s].data;
+                retval++;
+                if (mask & EPOLLONESHOT)
+                    set->events[s].events = EPOLLONESHOT; // disabled until EPOLL_CTL_MOD
             }
         }
+        if (retval || timeout == 0)
+            break;
+
+        SGIP_INTR_UNPROTECT();
+        w = sgIP_sockets_WaitEvent(seen, starttime,
+                                   timeout < 0 ? SGIP_SOCKET_WAIT_FOREVER : timeout);
+        SGIP_INTR_REPROTECT();
+        if (!w)
+            break;
     }
+    SGIP_INTR_UNPROTECT();
+    return retval;
+}
 
-    // writefds
-    if (writefds)
+// Works out which SOCKET_EVENT_* events a socket (0-based) should report to its callback.
+// Readable and accepted are reported every time something happens while they hold, the others
+// only when they become true.
+static int sgIP_sockets_CallbackEvents(int s)
+{
+    int ready  = sgIP_sockets_Readiness(s);
+    int events = 0;
+    int level  = 0;
+    if ((socketlist[s].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
     {
-        for (i = 0; i < nfds; i++)
+        sgIP_Record_TCP *rec = (sgIP_Record_TCP *)socketlist[s].conn_ptr;
+        if (rec->tcpstate == SGIP_TCP_STATE_LISTEN)
         {
-            if (FD_ISSET(i + 1, writefds))
-            {
-                if ((socketlist[i].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_TCP)
-                {
-                    rec = (sgIP_Record_TCP *)socketlist[i].conn_ptr;
-                    j   = rec->buf_tx_in - 1;
-                    if (j < 0)
-                        j = SGIP_TCP_TRANSMITBUFFERLENGTH - 1;
-
-                    if (rec->buf_tx_out == j)
-                    {
-                        FD_CLR(i + 1, writefds);
-                    }
-                    else
-                    {
-                        retval++;
-                    }
-                }
-            }
+            if (ready & POLLIN)
+                level |= SOCKET_EVENT_ACCEPTED;
+            ready = 0;
+        }
+        else if (rec->tcpstate > SGIP_TCP_STATE_SYN_RECEIVED
+                 && rec->tcpstate != SGIP_TCP_STATE_CLOSED)
+        {
+            level |= SOCKET_EVENT_CONNECTED;
         }
+        if (rec->errorcode)
+            level |= SOCKET_EVENT_ERROR;
+    }
+    else if ((socketlist[s].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_UDP)
+    {
+        if (((sgIP_Record_UDP *)socketlist[s].conn_ptr)->errorcode)
+            level |= SOCKET_EVENT_ERROR; // an ICMP error for a connected socket
     }
+    if (ready & POLLIN)
+        level |= SOCKET_EVENT_READABLE;
+    if (ready & POLLOUT)
+        level |= SOCKET_EVENT_WRITABLE;
+
+    events |= level & ~socketlist[s].callbacklast;
+    socketlist[s].callbacklast = level;
+    return events & socketlist[s].callbackevents;
+}
 
-    if (errorfds)
+int setsocketcallback(int socket, int events, socket_callback callback, void *userdata)
+{
+    if (socket < 1 || socket > SGIP_SOCKET_MAXSOCKETS)
+        return SGIP_ERROR(EINVAL);
+
+    SGIP_INTR_PROTECT();
+    socket--;
+    if (!(socketlist[socket].flags & SGIP_SOCKET_FLAG_VALID)
+        || (socketlist[socket].flags & SGIP_SOCKET_FLAG_TYPEMASK) == SGIP_SOCKET_FLAG_TYPE_EPOLL)
     {
-        FD_ZERO(errorfds);
+        SGIP_INTR_UNPROTECT();
+        return SGIP_ERROR(EINVAL);
     }
+    socketlist[socket].callback       = events ? callback : 0;
+    socketlist[socket].callbackdata   = userdata;
+    socketlist[socket].callbackevents = events;
+    socketlist[socket].callbacklast   = 0;
+    if (socketlist[socket].callback)
+        callbackpending[socket >> 5] |= 1u << (socket & 31); // report the current state
+    else
+        callbackpending[socket >> 5] &= ~(1u << (socket & 31));
+    SGIP_INTR_UNPROTECT();
+    return 0;
+}
+
+// Runs the callbacks of the sockets that have had activity since the last call. The application
+// calls this from its main loop, so callbacks never run in interrupt context and are free to call
+// send()/recv()/accept() (non-blocking).
+static void sgIP_sockets_RunCallbacks(void)
+{
+    static int running = 0;
+    socket_callback callback;
+    void *userdata;
+    int w, s, events;
 
+    SGIP_INTR_PROTECT();
+    if (running) // a callback caused this call, the outer loop will pick up the new events.
+    {
+        SGIP_INTR_UNPROTECT();
+        return;
+    }
+    running = 1;
+    for (w = 0; w < SGIP_SOCKET_WORDS; w++)
+    {
+        while (callbackpending[w])
+        {
+            s = __builtin_ctz(callbackpending[w]);
+            callbackpending[w] &= ~(1u << s);
+            s += w * 32;
+
+            callback = socketlist[s].callback;
+            userdata = socketlist[s].callbackdata;
+            events   = sgIP_sockets_CallbackEvents(s);
+            if (!callback || !events)
+                continue;
+
+            SGIP_INTR_UNPROTECT();
+            callback(s + 1, events, userdata);
+            SGIP_INTR_REPROTECT();
+        }
+    }
+    running = 0;
     SGIP_INTR_UNPROTECT();
-    return retval;
+}
+
+void socket_run_callbacks(void)
+{
+    sgIP_sockets_RunCallbacks();
+    sgIP_DNS_RunDone();
 }
 
 #if 0
@@ -13,17 +13,21 @@ extern "C" {
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
 #include "arm9/sgIP/sgIP_Config.h"
+#include "arm9/sgIP/sgIP_TCP.h"
 
 #define SGIP_SOCKET_FLAG_ALLOCATED    0x8000
 #define SGIP_SOCKET_FLAG_NONBLOCKING  0x4000
 #define SGIP_SOCKET_FLAG_VALID        0x2000
 #define SGIP_SOCKET_FLAG_CLOSING      0x1000
-#define SGIP_SOCKET_FLAG_TYPEMASK     0x0001
+#define SGIP_SOCKET_FLAG_TYPEMASK     0x0003
 #define SGIP_SOCKET_FLAG_TYPE_TCP     0x0001
 #define SGIP_SOCKET_FLAG_TYPE_UDP     0x0000
+#define SGIP_SOCKET_FLAG_TYPE_EPOLL   0x0002
 #define SGIP_SOCKET_MASK_CLOSE_COUNT  0xFFFF0000
 #define SGIP_SOCKET_SHIFT_CLOSE_COUNT 16
 
@@ -32,14 +36,34 @@ extern "C" {
 // 5 minutes assuming 1000ms ticks = 300 = 0x12c
 #define SGIP_SOCKET_VALUE_CLOSE_COUNT (0x12c << SGIP_SOCKET_SHIFT_CLOSE_COUNT)
 
+#define SGIP_SOCKET_WORDS ((SGIP_SOCKET_MAXSOCKETS + 31) / 32) // words in a bitmap of sockets
+
 typedef struct SGIP_SOCKET_DATA
 {
     unsigned int flags;
     void *conn_ptr;
+    unsigned int epollsets;   // bit n set: the socket is in the interest list of epoll set n
+    socket_callback callback; // see setsocketcallback()
+    void *callbackdata;
+    int callbackevents; // SOCKET_EVENT_* the callback wants
+    int callbacklast;   // edge-triggered events that were true the last time it was checked
 } sgIP_socket_data;
 
+// sgIP_epoll_set - the interest list of an epoll instance.
+typedef struct SGIP_EPOLL_SET
+{
+    int socket; // socket number of the epoll instance, 0 if the set is free
+    unsigned int interest[SGIP_SOCKET_WORDS];
+    unsigned int pending[SGIP_SOCKET_WORDS]; // sockets that may be ready, checked by epoll_wait
+    struct epoll_event events[SGIP_SOCKET_MAXSOCKETS]; // requested events and user data
+} sgIP_epoll_set;
+
 void sgIP_sockets_Init(void);
 void sgIP_sockets_Timer1000ms(void);
+void sgIP_sockets_ReleaseTCPRecord(sgIP_Record_TCP *rec);
+void sgIP_sockets_Notify(int socket);
+void sgIP_sockets_TakeActivity(unsigned int *bits);
+int sgIP_sockets_SetNonBlocking(int socket, int nonblocking);
 
 // sys/socket.h
 int socket(int domain, int type, int protocol);
@@ -51,6 +75,11 @@ int sendto(int socket, const void *data, int sendlength, int flags, const struct
            int addr_len);
 int recvfrom(int socket, void *data, int recvlength, int flags, struct sockaddr *addr,
              int *addr_len);
+int sendmsg(int socket, const struct msghdr *msg, int flags);
+int recvmsg(int socket, struct msghdr *msg, int flags);
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
 int listen(int socket, int max_connections);
 int accept(int socket, struct sockaddr *addr, int *addr_len);
 int shutdown(int socket, int shutdown_type);
@@ -65,10 +94,22 @@ int getsockopt(int socket, int level, int option_name, void *data, int *data_len
 int getpeername(int socket, struct sockaddr *addr, int *addr_len);
 int getsockname(int socket, struct sockaddr *addr, int *addr_len);
 
+// sys/uio.h
+int readv(int socket, const struct iovec *iov, int iovcnt);
+int writev(int socket, const struct iovec *iov, int iovcnt);
+
 // sys/time.h (actually intersects partly with libnds, so I'm letting libnds handle fd_set for the
 // time being)
 int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
 
+int setsocketcallback(int socket, int events, socket_callback callback, void *userdata);
+
+// poll.h, sys/epoll.h
+int poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int epoll_create(int size);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+
 // arpa/inet.h
 unsigned long inet_addr(const char *cp);
 
@@ -56,9 +56,59 @@ const char *ASSOCSTATUS_STRINGS[] = {
 // This function is used in socket handling code when the user has selected
 // blocking mode. They are called after every retry to give interrupts a chance
 // to happen (interrupts are disabled in critical sections).
-void sgIP_IntrWaitEvent(void)
+//
+// Everything that can make progress on a socket happens in an interrupt handler
+// (Wifi_Update() runs from the IPC FIFO interrupt, Wifi_Timer() from a timer or
+// the VBlank interrupt), so halting the CPU until the next interrupt wakes the
+// caller as soon as there is something to check, without burning CPU time.
+//
+// The caller has read sgIP_sockets_events as 'seen' while it was protected. If
+// it has changed, something happened after the caller checked, and it must not
+// sleep. Interrupts that come in between this check and the wait end the wait
+// right away, so they aren't lost until the next one.
+//
+// With cothreads the calling thread is parked instead, until the stack sends
+// SGIP_COTHREAD_SIGNAL (on socket activity and every timer tick). Other threads
+// run in the meantime, and the scheduler halts the CPU if all of them wait.
+void sgIP_IntrWaitEvent(unsigned long seen)
 {
-    swiDelay(20000);
+    // Packets sent to ourselves are received here, there's no interrupt for them.
+    if (sgIP_Hub_RunLoopback())
+        return;
+
+    // If interrupts can't happen right now nothing would wake us up. Just give
+    // the ARM7 (and other threads) a bit of time instead.
+    if (REG_IME == 0 || REG_IE == 0)
+    {
+#ifdef SGIP_COTHREAD_WAIT
+        cothread_yield();
+#else
+        swiDelay(20000);
+#endif
+        return;
+    }
+
+#ifdef SGIP_COTHREAD_WAIT
+    // Checked right before parking. The signal is also sent on every timer
+    // tick, so the few instructions until the thread is registered as waiting
+    // can't hold it up for long.
+    if (sgIP_sockets_events != seen)
+        return;
+    cothread_yield_signal(SGIP_COTHREAD_SIGNAL);
+#else
+    int oldIME = enterCriticalSection();
+    if (sgIP_sockets_events != seen)
+    {
+        leaveCriticalSection(oldIME);
+        return;
+    }
+    // Forget the interrupts that have already been handled. Any interrupt from
+    // now on, even one that comes in before swiIntrWait() halts, ends the wait.
+    u32 irqs = REG_IE;
+    INTR_WAIT_FLAGS &= ~irqs;
+    leaveCriticalSection(oldIME);
+    swiIntrWait(0, irqs);
+#endif
 }
 
 #ifdef SGIP_DEBUG
@@ -126,8 +176,6 @@ static void ethhdr_print(char f, void *d)
 
 int Wifi_TransmitFunction(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
 {
-    (void)hw;
-
     if (!(WifiData->flags9 & WFLAG_ARM9_NETUP))
     {
         SGIP_DEBUG_MESSAGE(("Transmit:err_netdown"));
@@ -302,11 +350,20 @@ int Wifi_TransmitFunction(sgIP_Hub_HWInterface *hw, sgIP_memblock *mb)
     WifiData->stats[WSTAT_TXQUEUEDPACKETS]++;
     WifiData->stats[WSTAT_TXQUEUEDBYTES] += hdrlen + body_size;
 
-    Wifi_CallSyncHandler();
+    // When sending a batch of packets, notify the ARM7 once at the end.
+    if (!sgIP_Hub_DeferFlush(hw))
+        Wifi_CallSyncHandler();
 
     return 0;
 }
 
+static void Wifi_FlushFunction(sgIP_Hub_HWInterface *hw)
+{
+    (void)hw;
+
+    Wifi_CallSyncHandler();
+}
+
 int Wifi_Interface_Init(sgIP_Hub_HWInterface *hw)
 {
     hw->MTU       = 2300;
@@ -458,6 +515,7 @@ void Wifi_SetIP(u32 IPaddr, u32 gateway, u32 subnetmask, u32 dns1, u32 dns2)
         wifi_hw->dns[1]  = dns2;
         // reset arp cache...
         sgIP_ARP_FlushInterface(wifi_hw);
+        sgIP_Hub_RoutesChanged();
     }
 }
 
@@ -488,7 +546,10 @@ void Wifi_Update(void)
             WifiData->flags9 |= WFLAG_ARM9_ARM7READY;
             // add network interface.
             wifi_hw = sgIP_Hub_AddHardwareInterface(&Wifi_TransmitFunction, &Wifi_Interface_Init);
+            if (wifi_hw)
+                wifi_hw->FlushFunction = &Wifi_FlushFunction;
             sgIP_timems = WifiData->random; // hacky! but it should work just fine :)
+            sgIP_AddEntropy(WifiData->random);
         }
     }
     if (WifiData->authlevel != WIFI_AUTHLEVEL_ASSOCIATED && WifiData->flags9 & WFLAG_ARM9_NETUP)
@@ -499,6 +560,8 @@ void Wifi_Update(void)
              && !(WifiData->flags9 & WFLAG_ARM9_NETUP))
     {
         WifiData->flags9 |= WFLAG_ARM9_NETUP;
+        // with a static address the neighbours can be resolved right away, DHCP does it later.
+        sgIP_ARP_ResolveNeighbours(wifi_hw);
     }
 
 #endif
@@ -517,6 +580,11 @@ void Wifi_Update(void)
             base2 -= WIFI_RXBUFFER_SIZE / 2;
 
 #ifdef WIFI_USE_TCP_SGIP
+        // The ARM7 keeps stirring hardware random numbers into WifiData->random, and the signal
+        // strength of the packets is noisy.
+        sgIP_AddEntropy(WifiData->random ^ (Wifi_RxReadHWordOffset(base * 2, HDR_RX_MAX_RSSI) << 16)
+                        ^ sgIP_timems);
+
         // Only send packets to sgIP if we are trying to access the Internet
         if (WifiData->curLibraryMode == DSWIFI_INTERNET)
             Wifi_sgIpHandlePacket(base2, len);
@@ -535,4 +603,9 @@ void Wifi_Update(void)
         if (cnt++ > 80)
             break;
     }
+
+#ifdef WIFI_USE_TCP_SGIP
+    sgIP_Hub_RunLoopback();
+    sgIP_DNS_Update();
+#endif
 }